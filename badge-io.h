@@ -0,0 +1,451 @@
+#pragma once
+#include <memory>
+#include "fluid-sim.h"
+#include "io-tasks.h"
+#include "i2c-bus.h"
+#include "clock-governor.h"
+#include "sim-snapshot.h"
+#include "text-attractor.h"
+#include "tilt-latency.h"
+
+// Core 0's I/O as cooperative tasks. Each frame the accelerometer is read first, so the
+// simulation gets the freshest tilt, then the LED drivers are uploaded one at a time and
+// the housekeeping runs last. A task waiting on a transfer gives the core to the others.
+// While the bus is being recovered the simulation keeps the last tilt and the drivers
+// keep showing the last frame they were sent. On the low-latency path the upload waits for
+// the frame simulated from this tick's read instead of sending the newest one at the tick.
+
+static constexpr uint32_t accelTimeoutUs{1000};
+static constexpr uint32_t ledWriteTimeoutUs{10000};
+
+// Wire time of one driver's upload, its address and register bytes
+constexpr uint32_t ledDriverUs(size_t driver){
+    return (2 + panel.upload[driver].registers) * i2cByteUs;
+}
+
+constexpr uint32_t ledUploadUs(){
+    uint32_t us = 0;
+    for(size_t d = 0; d < panelDrivers; d++){
+        us += ledDriverUs(d);
+    }
+    return us;
+}
+
+// On the low-latency path a write that moves no byte for this long, about twenty byte
+// times, counts as hung, so the recovery starts inside the frame the step left for the
+// upload. Refills held up by the other tasks don't count, see i2cBus.
+static constexpr uint32_t lowLatencyStallUs{500};
+
+// Address, register, repeated start address and six data bytes
+static constexpr uint32_t accelReadUs{9 * i2cByteUs};
+static constexpr uint32_t lowLatencyMarginUs{1000};
+// With the read, step and upload chained in one frame the step gets what the bus leaves
+static constexpr uint32_t lowLatencyBudgetUs{1000000 / framesPerSecond - accelReadUs - ledUploadUs() - lowLatencyMarginUs};
+
+class accelTask : public ioTask {
+    public:
+        accelTask(frameScheduler& scheduler, i2cBus& bus, tiltLatency& latency)
+            : ioTask(scheduler.clock), scheduler(scheduler), bus(bus), latency(latency) {}
+        int16_t x{0};
+        int16_t y{0};
+        int16_t z{0};
+        std::atomic<uint32_t> sampleUs{0};  // When x and y were read, stored after them
+        uint32_t reads{0};
+        uint32_t cachedFrames{0};  // Frames the bus was recovering and the last tilt stood in
+        void run() override;
+    private:
+        frameScheduler& scheduler;
+        i2cBus& bus;
+        tiltLatency& latency;
+        uint32_t frame{0};
+        std::array<uint8_t, 6> data{};  // X, Y and Z, low byte first
+        busStatus status{busStatus::busy};
+};
+
+void accelTask::run(){
+    TASK_BEGIN();
+    while(true){
+        TASK_WAIT_UNTIL(scheduler.currentFrame() > frame, scheduler.deadlineUs(frame));
+        frame = scheduler.currentFrame();
+        TASK_WAIT_UNTIL(bus.recovering() || bus.acquire(this), bus.readyUs());
+        if(bus.recovering()){
+            cachedFrames++;
+            latency.sampled(frame);
+            continue;
+        }
+        // MSB of the register address auto-increments through all six
+        bus.startWriteRead(LIS3DH_ADDR, OUT_X_L | 0x80, data.data(), data.size(), accelTimeoutUs);
+        TASK_WAIT_UNTIL((status = bus.poll()) != busStatus::busy, bus.readyUs());
+        if(status == busStatus::done){
+            y = -(int16_t)(data[1] << 8 | data[0]);
+            x = -(int16_t)(data[3] << 8 | data[2]);
+            z = (int16_t)(data[5] << 8 | data[4]);
+            sampleUs.store(static_cast<uint32_t>(clock.nowUs()), std::memory_order_release);
+            reads++;
+        } else {
+            telemetry.log(telemetryEvent::accelFailed, 0, bus.abortSource);
+            bus.recover();
+        }
+        bus.release(this);
+        latency.sampled(frame);
+    }
+    TASK_END();
+}
+
+class ledUploadTask : public ioTask {
+    public:
+        ledUploadTask(frameScheduler& scheduler, i2cBus& bus, tripleBuffer<ledFrame>& frames, tiltLatency& latency)
+            : ioTask(scheduler.clock), scheduler(scheduler), bus(bus), frames(frames), latency(latency) {}
+        uint32_t uploadedFrame{0};
+        uint32_t skippedFrames{0};  // Not fully uploaded because the bus was recovering
+        void run() override;
+    private:
+        frameScheduler& scheduler;
+        i2cBus& bus;
+        tripleBuffer<ledFrame>& frames;
+        tiltLatency& latency;
+        uint32_t frame{0};
+        uint64_t giveUpUs{0};
+        const ledFrame* uploading{nullptr};
+        size_t driver{0};
+        busStatus status{busStatus::busy};
+};
+
+// The bus is given up between drivers so the accelerometer never waits for a whole frame.
+// A recovery ends the frame's upload early, the next frame sends every driver again.
+void ledUploadTask::run(){
+    TASK_BEGIN();
+    while(true){
+        TASK_WAIT_UNTIL(scheduler.currentFrame() > frame, scheduler.deadlineUs(frame));
+        frame = scheduler.waitForFrame(frameStage::io);
+        // Late enough that the upload still ends by the deadline, then the last frame goes again
+        giveUpUs = scheduler.deadlineUs(frame) - ledUploadUs();
+        TASK_WAIT_UNTIL(!latency.lowLatency || latency.publishedFrame.load(std::memory_order_acquire) >= frame
+                        || clock.nowUs() >= giveUpUs, std::min(giveUpUs, clock.nowUs() + latencyPollUs));
+        uploading = &frames.acquire();
+        for(driver = 0; driver < panelDrivers; driver++){
+            TASK_WAIT_UNTIL(bus.recovering() || bus.acquire(this), bus.readyUs());
+            if(bus.recovering()){
+                skippedFrames++;
+                break;
+            }
+            bus.startWrite(panel.upload[driver].address, uploading->drivers[driver].data(),
+                           1 + panel.upload[driver].registers,
+                           latency.lowLatency ? lowLatencyStallUs : ledWriteTimeoutUs);
+            TASK_WAIT_UNTIL((status = bus.poll()) != busStatus::busy, bus.readyUs());
+            if(status == busStatus::failed){
+                telemetry.log(telemetryEvent::ledWriteFailed, driver, bus.abortSource);
+                bus.recover();
+            }
+            bus.release(this);
+        }
+        if(driver == panelDrivers){
+            latency.shown(uploading->stamp, static_cast<uint32_t>(clock.nowUs()));
+        }
+        scheduler.finishFrame(frameStage::io);
+        uploadedFrame = frame;
+    }
+    TASK_END();
+}
+
+class housekeepingTask : public ioTask {
+    public:
+        housekeepingTask(frameScheduler& scheduler, i2cBus& bus, ledUploadTask& leds, accelTask& accel,
+                         fluidWindow& window, clockGovernor& governor, snapshotMailbox& mailbox, ioScheduler& io,
+                         tiltLatency& latency)
+            : ioTask(scheduler.clock), scheduler(scheduler), bus(bus), leds(leds), accel(accel),
+              window(window), governor(governor), mailbox(mailbox), io(io), latency(latency) {}
+        void run() override;
+    private:
+        frameScheduler& scheduler;
+        i2cBus& bus;
+        ledUploadTask& leds;
+        accelTask& accel;
+        fluidWindow& window;
+        clockGovernor& governor;
+        snapshotMailbox& mailbox;
+        ioScheduler& io;
+        tiltLatency& latency;
+        uint32_t frame{0};
+        void logStats();
+};
+
+void housekeepingTask::run(){
+    TASK_BEGIN();
+    while(true){
+        TASK_WAIT_UNTIL(leds.uploadedFrame > frame, leds.wakeUs);
+        frame = leds.uploadedFrame;
+#if PICO_ON_DEVICE
+        gpio_put(25, accel.x > 0);
+#endif
+        // Clock changes and flash writes both happen with the bus idle
+        TASK_WAIT_UNTIL(bus.acquire(this), bus.readyUs());
+        {
+            // The last step saw the tilt or state move, or already had to cut quality, either
+            // way the next frames need the speed. The budget is only set before the cores start.
+            frameStageStats& sim = scheduler.stats(frameStage::sim);
+            bool motion = window.moving.load(std::memory_order_acquire);
+            governor.update(sim.busyUs, window.quality.budgetUs, motion);
+            telemetry.log(telemetryEvent::clockFrame, governor.khz() / 1000, sim.busyUs, sim.slackUs > 0 ? sim.slackUs : 0);
+        }
+#if PICO_ON_DEVICE
+        if(mailbox.pending.load(std::memory_order_acquire)){
+            uint32_t start = time_us_32();
+            bool saved = writeSnapshot(mailbox.snapshot);
+            telemetry.log(telemetryEvent::snapshotSaved, saved, time_us_32() - start);
+            mailbox.pending.store(false, std::memory_order_release);
+        }
+#endif
+        bus.release(this);
+        // Half a period apart so neither fills the telemetry ring
+        if(frame % (10*framesPerSecond) == 0){
+            logStats();
+        } else if(frame % (10*framesPerSecond) == 5*framesPerSecond){
+            latency.logStats();
+        }
+        telemetry.drain();
+    }
+    TASK_END();
+}
+
+void housekeepingTask::logStats(){
+    scheduler.logStats();
+    for(uint16_t level = 0; level < clockLevelsKhz.size(); level++){
+        telemetry.log(telemetryEvent::clockLevels, clockLevelsKhz[level] / 1000, governor.framesAtLevel[level]);
+    }
+    telemetry.log(telemetryEvent::qualityLevel, window.quality.level, window.quality.frameUs);
+    for(uint16_t level = 0; level < qualityLevels.size(); level++){
+        telemetry.log(telemetryEvent::qualityFrames, level, window.quality.framesAtLevel[level]);
+    }
+    telemetry.log(telemetryEvent::sleeping, window.sleepingParticles);
+    telemetry.log(telemetryEvent::binningUpdates, 0, window.binning.fullRebuilds, window.binning.incrementalUpdates);
+    telemetry.log(telemetryEvent::binningMoves, 0, window.binning.particlesMoved, window.binning.slotSwaps);
+    telemetry.log(telemetryEvent::busRecoveries, 0, bus.recoveries, io.worstRunUs);
+    telemetry.log(telemetryEvent::busCached, 0, accel.cachedFrames, leds.skippedFrames);
+}
+
+static constexpr size_t maxNameLength{31};
+
+// Takes a new name over USB as one line of text and swaps its field in. An empty line
+// goes back to the built-in name. The field is built a column at a time with the other
+// tasks running in between, a bus transfer held up by a column only stretches the clock.
+class nameTask : public ioTask {
+    public:
+        nameTask(frameScheduler& scheduler, attractorBuilder& builder)
+            : ioTask(scheduler.clock), scheduler(scheduler), builder(builder) {}
+        uint32_t namesBuilt{0};
+        void request(const char* text);  // As if the line had come over USB
+        void run() override;
+    private:
+        frameScheduler& scheduler;
+        attractorBuilder& builder;
+        std::array<char, maxNameLength + 1> line{};
+        uint8_t length{0};
+        bool lineReady{false};
+        char last{0};
+        uint32_t simFrames{0};
+        uint64_t startUs{0};
+        bool fits{true};
+        bool readLine();
+};
+
+void nameTask::request(const char* text){
+    length = 0;
+    while(text[length] != '\0' && length < maxNameLength){
+        line[length] = text[length];
+        length++;
+    }
+    lineReady = true;
+}
+
+// Either of CR and LF ends a line, CR LF counts once
+bool nameTask::readLine(){
+#if PICO_ON_DEVICE
+    int c;
+    while(!lineReady && (c = getchar_timeout_us(0)) != PICO_ERROR_TIMEOUT){
+        if(c == '\r' || (c == '\n' && last != '\r')){
+            lineReady = true;
+        } else if(c != '\n' && length < maxNameLength){
+            line[length++] = static_cast<char>(c);
+        }
+        last = static_cast<char>(c);
+    }
+#endif
+    return lineReady;
+}
+
+void nameTask::run(){
+    TASK_BEGIN();
+    while(true){
+        TASK_WAIT_UNTIL(readLine(), scheduler.deadlineUs(scheduler.currentFrame()));
+        line[length] = '\0';
+        startUs = clock.nowUs();
+        // The simulating core may be reading the runtime field, so it goes back to the
+        // built-in one until the frame in flight is over before the field is rewritten
+        activeAttractor.store(&builtinAttractor, std::memory_order_release);
+        simFrames = scheduler.stats(frameStage::sim).frames;
+        TASK_WAIT_UNTIL(scheduler.stats(frameStage::sim).frames > simFrames, scheduler.deadlineUs(scheduler.currentFrame()));
+        fits = rasterizeText(line.data(), builder.mask);
+        builder.start();
+        if(length > 0){
+            while(!builder.step()){
+                TASK_YIELD();
+            }
+            activeAttractor.store(&builder.attractor, std::memory_order_release);
+            namesBuilt++;
+        }
+        telemetry.log(telemetryEvent::attractorBuilt, builder.cells(), clock.nowUs() - startUs, fits);
+        length = 0;
+        lineReady = false;
+    }
+    TASK_END();
+}
+
+#if !PICO_ON_DEVICE
+// Stands in for core 1, every frame is simulated the moment its tick comes round, or on
+// the low-latency path once the tick's read is in. The step is taken to last stepUs of the
+// simulated clock, the host's own is far quicker than the badge's.
+class hostSimTask : public ioTask {
+    public:
+        hostSimTask(frameScheduler& scheduler, accelTask& accel, fluidWindow& window, tripleBuffer<ledFrame>& frames,
+                    tiltLatency& latency)
+            : ioTask(scheduler.clock), scheduler(scheduler), accel(accel), window(window), frames(frames), latency(latency) {}
+        uint32_t stepUs{0};
+        void run() override;
+    private:
+        frameScheduler& scheduler;
+        accelTask& accel;
+        fluidWindow& window;
+        tripleBuffer<ledFrame>& frames;
+        tiltLatency& latency;
+        uint32_t frame{0};
+        uint64_t giveUpUs{0};
+        uint64_t stepStartUs{0};
+        tiltStamp stamp;
+};
+
+void hostSimTask::run(){
+    TASK_BEGIN();
+    while(true){
+        TASK_WAIT_UNTIL(scheduler.currentFrame() > frame, scheduler.deadlineUs(frame));
+        frame = scheduler.waitForFrame(frameStage::sim);
+        giveUpUs = scheduler.deadlineUs(frame - 1) + maxSampleWaitUs;
+        TASK_WAIT_UNTIL(!latency.lowLatency || latency.sampledFrame.load(std::memory_order_acquire) >= frame
+                        || clock.nowUs() >= giveUpUs, std::min(giveUpUs, clock.nowUs() + latencyPollUs));
+        stamp.frame = frame;
+        stamp.sampleUs = accel.sampleUs.load(std::memory_order_acquire);
+        stepStartUs = clock.nowUs();
+        stamp.stepUs = static_cast<uint32_t>(stepStartUs);
+        window.tiltX = accel.x;
+        window.tiltY = accel.y;
+        window.stepSim();
+        TASK_SLEEP_UNTIL(stepStartUs + stepUs);
+        stamp.publishUs = static_cast<uint32_t>(clock.nowUs());
+        window.frame.stamp = stamp;
+        frames.back() = window.frame;
+        frames.publish();
+        latency.published(frame);
+        scheduler.finishFrame(frameStage::sim);
+    }
+    TASK_END();
+}
+
+// Runs the badge's I/O tasks against the mock bus on a simulated clock. With faultEvery
+// set, faultBurst transfers in a row out of every faultEvery time out, and blocking 1
+// recovers the bus the old way with core 0 held for it. lowLatency 1 chains the read, step
+// and upload, stepUs is how long a step is taken to last, cut to the budget the quality
+// controller would hold it to.
+//
+//   my_project io [seconds] [name or -] [faultEvery] [faultBurst] [blocking] [lowLatency] [stepUs]
+int runIoSimulation(int argc, char** argv){
+    uint32_t seconds = argc > 2 ? atoi(argv[2]) : 10;
+    const char* name = argc > 3 && strcmp(argv[3], "-") != 0 ? argv[3] : nullptr;
+
+    auto window = std::make_unique<fluidWindow>();
+    auto frames = std::make_unique<tripleBuffer<ledFrame>>();
+    frameScheduler scheduler;
+    i2cBus bus(scheduler.clock);
+    clockGovernor governor;
+    snapshotMailbox mailbox;
+    ioScheduler io(scheduler.clock);
+    tiltLatency latency;
+    accelTask accel(scheduler, bus, latency);
+    ledUploadTask leds(scheduler, bus, *frames, latency);
+    housekeepingTask housekeeping(scheduler, bus, leds, accel, *window, governor, mailbox, io, latency);
+    hostSimTask sim(scheduler, accel, *window, *frames, latency);
+    auto builder = std::make_unique<attractorBuilder>();
+    nameTask names(scheduler, *builder);
+    io.add(bus);
+    io.add(accel);
+    io.add(leds);
+    io.add(housekeeping);
+    io.add(names);
+    io.add(sim);
+
+    window->init(1);
+    frames->init();
+    governor.init();
+    // About 1 g straight down in raw counts at +-8 g, the badge reads Y negated
+    int16_t down = -4000;
+    bus.readData = {static_cast<uint8_t>(down), static_cast<uint8_t>(down >> 8), 0, 0, 0, 0};
+
+    bus.faultEvery = argc > 4 ? atoi(argv[4]) : 0;
+    bus.faultBurst = argc > 5 ? atoi(argv[5]) : 1;
+    bus.blockingRecovery = argc > 6 && atoi(argv[6]) != 0;
+    latency.lowLatency = argc > 7 && atoi(argv[7]) != 0;
+    if(latency.lowLatency){
+        window->quality.budgetUs = lowLatencyBudgetUs;
+    }
+    uint32_t stepUs = argc > 8 ? atoi(argv[8]) : 10000;
+    sim.stepUs = std::min(stepUs, window->quality.budgetUs);
+
+    if(name){
+        window->state = enumBadgeState::displayname1;
+        names.request(name);
+    }
+
+    scheduler.start(20);
+    uint64_t endUs = scheduler.clock.nowUs() + static_cast<uint64_t>(seconds) * 1000000;
+    uint32_t steps = 0;
+    while(scheduler.clock.nowUs() < endUs){
+        io.step();
+        io.idle();
+        steps++;
+    }
+
+    frameStageStats& st = scheduler.stats(frameStage::io);
+    printf("%lu s simulated in %lu scheduler steps\n", (unsigned long)seconds, (unsigned long)steps);
+    printf("io frames %lu, overruns %lu, dropped %lu, worst busy %lu us\n", (unsigned long)st.frames,
+           (unsigned long)st.overruns, (unsigned long)st.droppedFrames, (unsigned long)st.worstBusyUs);
+    printf("accelerometer reads %lu, tilt %d %d\n", (unsigned long)accel.reads, accel.x, accel.y);
+    printf("bus transfers %lu, %lu bytes, busy %.1f%%\n", (unsigned long)bus.transfers, (unsigned long)bus.bytes,
+           100.0 * bus.busyUs / (seconds * 1000000.0));
+    printf("failed transfers %lu, recoveries %lu, frames on cached tilt %lu, led frames skipped %lu\n",
+           (unsigned long)bus.failedTransfers, (unsigned long)bus.recoveries, (unsigned long)accel.cachedFrames,
+           (unsigned long)leds.skippedFrames);
+    printf("worst stall of core 0 by one task %lu us\n", (unsigned long)io.worstRunUs);
+    printf("frames at each clock level:");
+    for(uint32_t frames : governor.framesAtLevel){
+        printf(" %lu", (unsigned long)frames);
+    }
+    printf("\n");
+    printf("%s path, step %lu us, tilt to LEDs over %lu frames:\n", latency.lowLatency ? "low-latency" : "tick-driven",
+           (unsigned long)sim.stepUs, (unsigned long)latency.segment(latencySegment::total).count);
+    const std::array<const char*, latencySegments> segmentNames{"sample to step", "step to publish", "publish to photon", "total"};
+    for(int s = 0; s < latencySegments; s++){
+        printf("  %-18s mean %6lu us, worst %6lu us\n", segmentNames[s], (unsigned long)latency.segments[s].meanUs(),
+               (unsigned long)latency.segments[s].worstUs);
+    }
+    const latencyHistogram& total = latency.segment(latencySegment::total);
+    for(int bin = 0; bin < latencyBins; bin++){
+        if(total.bins[bin] > 0){
+            printf("  %2lu-%2lu ms %6lu\n", (unsigned long)(bin * latencyBinUs / 1000), (unsigned long)((bin + 1) * latencyBinUs / 1000),
+                   (unsigned long)total.bins[bin]);
+        }
+    }
+    if(name){
+        printf("name \"%s\" built %lu times, %u attractor cells\n", name, (unsigned long)names.namesBuilt, builder->cells());
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,207 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "fluid-sim.h"
+#include "parallel-binning.h"
+#include "sim-snapshot.h"
+
+// Host-only batch mode for tuning. Runs many independent fluidWindows, each with its own
+// parameters, seed and input trace, on a pool of worker threads and prints one CSV line
+// of metrics per instance. Nothing is shared between instances but read-only tables.
+//
+//   my_project [instances] [frames] [threads] [trace file] [snapshot file] [reorder frames] [binning threads]
+//
+// Parameters are swept over a grid indexed by the instance number. Without a trace file,
+// or with "-", every instance gets a slowly swinging tilt starting at its own phase, a
+// trace file has one "tiltX tiltY state" line per frame and is replayed by every instance.
+// If the snapshot file holds a valid snapshot every instance starts from it rather than
+// from scattered particles, otherwise instance 0's final state is saved to it, "-" skips
+// it. Reorder frames is how often the particles are sorted into Morton order, 0 never.
+// With binning threads over 1 every worker keeps a pool that many threads wide for the
+// full rebuilds of its windows, which only takes over from parallelBinningMinParticles.
+
+static constexpr int16_t traceTiltAmplitude{4000};  // About 1 g in raw LIS3DH counts at +-8 g
+
+class inputSample {
+    public:
+        int16_t tiltX{0};
+        int16_t tiltY{0};
+        enumBadgeState state{enumBadgeState::normalg};
+};
+
+class batchMetrics {
+    public:
+        float divergenceResidual{0};  // Averaged over the run
+        float clumping{0};
+        float meanFrameUs{0};
+        float worstFrameUs{0};
+};
+
+class batchInstance {
+    public:
+        uint32_t id{0};
+        uint32_t seed{0};
+        simParams params;
+        std::vector<inputSample> trace;  // One sample per frame
+        const simSnapshot* warmStart{nullptr};
+        simSnapshot* finalState{nullptr};
+        batchMetrics metrics;
+};
+
+void runInstance(batchInstance& instance, workerPool* binningPool){
+    // A window is tens of KB, keep it off the worker's stack
+    auto window = std::make_unique<fluidWindow>();
+    window->params = instance.params;
+    window->binningPool = binningPool;
+    if(!instance.warmStart || !window->restore(*instance.warmStart)){
+        window->init(instance.seed);
+    }
+
+    double divergence = 0, clumping = 0, totalUs = 0, worstUs = 0;
+    for(const auto& sample : instance.trace){
+        window->tiltX = sample.tiltX;
+        window->tiltY = sample.tiltY;
+        window->state = sample.state;
+        auto start = std::chrono::steady_clock::now();
+        window->stepSim();
+        double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        totalUs += us;
+        worstUs = us > worstUs ? us : worstUs;
+        divergence += window->divergenceResidual();
+        clumping += window->clumping();
+    }
+
+    size_t frames = instance.trace.size() > 0 ? instance.trace.size() : 1;
+    instance.metrics.divergenceResidual = divergence / frames;
+    instance.metrics.clumping = clumping / frames;
+    instance.metrics.meanFrameUs = totalUs / frames;
+    instance.metrics.worstFrameUs = worstUs;
+    if(instance.finalState){
+        window->save(*instance.finalState);
+    }
+}
+
+void runInstances(std::vector<batchInstance>& instances, unsigned threads, unsigned binningThreads){
+    std::atomic<size_t> next{0};
+    std::vector<std::thread> pool;
+    for(unsigned t = 0; t < threads; t++){
+        pool.emplace_back([&instances, &next, binningThreads]{
+            std::unique_ptr<workerPool> binning;
+            if(binningThreads > 1){
+                binning = std::make_unique<workerPool>(binningThreads);
+            }
+            for(size_t i = next++; i < instances.size(); i = next++){
+                runInstance(instances[i], binning.get());
+            }
+        });
+    }
+    for(auto& worker : pool){
+        worker.join();
+    }
+}
+
+std::vector<inputSample> makeSwingTrace(uint32_t frames, uint32_t seed){
+    std::minstd_rand rng(seed);
+    float phase = std::uniform_real_distribution<float>(0, 2*M_PI)(rng);
+    std::vector<inputSample> trace(frames);
+    for(uint32_t f = 0; f < frames; f++){
+        // One full turn every four seconds
+        float angle = phase + f * 2*M_PI / (4*framesPerSecond);
+        trace[f].tiltX = traceTiltAmplitude * sinf(angle);
+        trace[f].tiltY = traceTiltAmplitude * cosf(angle);
+    }
+    return trace;
+}
+
+bool loadTrace(const char* path, std::vector<inputSample>& trace){
+    FILE* file = fopen(path, "r");
+    if(!file){
+        return false;
+    }
+    int tiltX, tiltY, state;
+    while(fscanf(file, "%d %d %d", &tiltX, &tiltY, &state) == 3){
+        trace.push_back({static_cast<int16_t>(tiltX), static_cast<int16_t>(tiltY), static_cast<enumBadgeState>(state)});
+    }
+    fclose(file);
+    return true;
+}
+
+// The four values of each knob, instance i takes digit i%4, (i/4)%4, ... of each
+static constexpr std::array<float, 4> sweepFlipRatio{0.8f, 0.9f, 0.95f, 1.0f};
+static constexpr std::array<uint8_t, 4> sweepPressureIterations{10, 20, 40, 60};
+static constexpr std::array<float, 4> sweepCompressionGain{0.5f, 1.0f, 1.5f, 2.0f};
+static constexpr std::array<float, 4> sweepCollisionDamping{0.99f, 0.995f, 0.999f, 1.0f};
+
+int runBatch(int argc, char** argv){
+    uint32_t count = argc > 1 ? atoi(argv[1]) : 256;
+    uint32_t frames = argc > 2 ? atoi(argv[2]) : 600;
+    unsigned threads = argc > 3 ? atoi(argv[3]) : std::thread::hardware_concurrency();
+    threads = threads > 0 ? threads : 1;
+
+    bool useTrace = argc > 4 && strcmp(argv[4], "-") != 0;
+    std::vector<inputSample> fileTrace;
+    if(useTrace && !loadTrace(argv[4], fileTrace)){
+        fprintf(stderr, "Can't read trace %s\n", argv[4]);
+        return 1;
+    }
+
+    const char* snapshotPath = argc > 5 && strcmp(argv[5], "-") != 0 ? argv[5] : nullptr;
+    auto snapshot = std::make_unique<simSnapshot>();
+    bool warmStart = snapshotPath && readSnapshot(*snapshot, snapshotPath);
+    uint16_t reorderFrames = argc > 6 ? atoi(argv[6]) : simParams{}.reorderFrames;
+    unsigned binningThreads = argc > 7 ? atoi(argv[7]) : 1;
+
+    std::vector<batchInstance> instances(count);
+    for(uint32_t i = 0; i < count; i++){
+        batchInstance& instance = instances[i];
+        instance.id = i;
+        instance.seed = i + 1;
+        instance.params.adaptiveQuality = false;
+        instance.params.flipRatio = sweepFlipRatio[i % 4];
+        instance.params.pressureIterations = sweepPressureIterations[(i / 4) % 4];
+        instance.params.compressionGain = sweepCompressionGain[(i / 16) % 4];
+        instance.params.collisionDamping = sweepCollisionDamping[(i / 64) % 4];
+        instance.params.reorderFrames = reorderFrames;
+        instance.trace = useTrace ? fileTrace : makeSwingTrace(frames, instance.seed);
+        instance.warmStart = warmStart ? snapshot.get() : nullptr;
+    }
+    if(snapshotPath && !warmStart && count > 0){
+        instances[0].finalState = snapshot.get();
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    runInstances(instances, threads, binningThreads);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("id,seed,flip_ratio,pressure_iterations,compression_gain,collision_damping,divergence,clumping,mean_frame_us,worst_frame_us\n");
+    for(const auto& instance : instances){
+        printf("%lu,%lu,%.3f,%u,%.2f,%.4f,%.5f,%.4f,%.1f,%.1f\n",
+               (unsigned long)instance.id, (unsigned long)instance.seed,
+               instance.params.flipRatio, instance.params.pressureIterations,
+               instance.params.compressionGain, instance.params.collisionDamping,
+               instance.metrics.divergenceResidual, instance.metrics.clumping,
+               instance.metrics.meanFrameUs, instance.metrics.worstFrameUs);
+    }
+    fprintf(stderr, "%lu instances x %lu frames on %u threads in %.2f s\n",
+            (unsigned long)count, (unsigned long)frames, threads, seconds);
+    // Everything the window keeps per particle, the rest of it is the grid
+    size_t perParticle = (sizeof(fluidWindow::particleArray) + sizeof(fluidWindow::particlePointers) + sizeof(fluidWindow::transfers)
+                          + sizeof(fluidWindow::particleSlot) + sizeof(fluidWindow::binnedCell)) / numParticles;
+    fprintf(stderr, "%lu particles, %lu bytes each of which %lu in fluidParticle, %lu bytes per window\n",
+            (unsigned long)numParticles, (unsigned long)perParticle, (unsigned long)sizeof(fluidParticle),
+            (unsigned long)sizeof(fluidWindow));
+    if(snapshotPath && !warmStart && count > 0){
+        if(!writeSnapshot(*snapshot, snapshotPath)){
+            fprintf(stderr, "Can't write snapshot %s\n", snapshotPath);
+            return 1;
+        }
+        fprintf(stderr, "Saved instance 0's final state to %s\n", snapshotPath);
+    }
+    return 0;
+}
@@ -0,0 +1,72 @@
+# Post-build check of where the linker put things, run with cmake -P
+#
+#   ELF          path to the linked executable
+#   NM, OBJDUMP  binutils for the target
+#   HOT_SYMBOLS  comma separated demangled function names that must not run from flash,
+#                template instantiations as nm -C prints them, e.g. f<(someEnum)0>
+#
+# Prints the size and memory region of every allocated section, then fails the build
+# if any hot symbol ended up in XIP flash.
+
+function(region_of address out)
+    math(EXPR addr "0x${address}")
+    if(addr GREATER_EQUAL 0x10000000 AND addr LESS 0x16000000)
+        set(${out} "flash" PARENT_SCOPE)
+    elseif(addr GREATER_EQUAL 0x20040000 AND addr LESS 0x20041000)
+        set(${out} "scratch_x" PARENT_SCOPE)
+    elseif(addr GREATER_EQUAL 0x20041000 AND addr LESS 0x20042000)
+        set(${out} "scratch_y" PARENT_SCOPE)
+    elseif(addr GREATER_EQUAL 0x20000000 AND addr LESS 0x20040000)
+        set(${out} "sram" PARENT_SCOPE)
+    else()
+        set(${out} "other" PARENT_SCOPE)
+    endif()
+endfunction()
+
+execute_process(COMMAND ${OBJDUMP} -h ${ELF} OUTPUT_VARIABLE sections RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "objdump failed on ${ELF}")
+endif()
+
+message(STATUS "Section sizes for ${ELF}")
+string(REPLACE "\n" ";" section_lines "${sections}")
+foreach(line IN LISTS section_lines)
+    if(line MATCHES "^ +[0-9]+ ([^ ]+) +([0-9a-f]+) +([0-9a-f]+)")
+        set(name ${CMAKE_MATCH_1})
+        math(EXPR size "0x${CMAKE_MATCH_2}")
+        region_of(${CMAKE_MATCH_3} region)
+        if(size GREATER 0 AND NOT region STREQUAL "other")
+            message(STATUS "  ${name}: ${size} bytes in ${region}")
+        endif()
+    endif()
+endforeach()
+
+if(NOT HOT_SYMBOLS)
+    return()
+endif()
+
+execute_process(COMMAND ${NM} -C ${ELF} OUTPUT_VARIABLE symbols RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "nm failed on ${ELF}")
+endif()
+
+string(REPLACE "," ";" hot_symbols "${HOT_SYMBOLS}")
+set(misplaced "")
+foreach(symbol IN LISTS hot_symbols)
+    string(REGEX REPLACE "([.+*?^$()])" "\\\\\\1" pattern "${symbol}")
+    # nm -C puts the return type in front of template instantiations
+    if(symbols MATCHES "(^|\n)([0-9a-f]+) [TtWw] ([^\n(]* )?${pattern}(\\(|\n|$)")
+        region_of(${CMAKE_MATCH_2} region)
+        if(region STREQUAL "flash")
+            list(APPEND misplaced "${symbol} at 0x${CMAKE_MATCH_2}")
+        endif()
+    else()
+        list(APPEND misplaced "${symbol} not found")
+    endif()
+endforeach()
+
+if(misplaced)
+    string(REPLACE ";" "\n  " misplaced "${misplaced}")
+    message(FATAL_ERROR "Hot symbols not placed in SRAM:\n  ${misplaced}")
+endif()
+message(STATUS "All hot symbols are in SRAM")
@@ -0,0 +1,122 @@
+#pragma once
+#include <array>
+#include "pico/stdlib.h"
+#include "fluid-sim.h"
+#if PICO_ON_DEVICE
+#include "hardware/clocks.h"
+#include "hardware/i2c.h"
+#endif
+
+// Runs the system clock only as fast as the frames need. A resting fluid is stepped down
+// one frequency at a time once the busy time measured at the current clock is predicted
+// to fit comfortably at the next lower one, any motion jumps straight back to full speed.
+
+// Fastest first, each one checked against the PLL at startup
+static constexpr std::array<uint32_t, 5> clockLevelsKhz{250000, 200000, 150000, 125000, 100000};
+static constexpr float clockDownMargin{0.6f};   // Predicted busy time must fit in 60% of the budget
+static constexpr uint16_t clockDownFrames{120}; // for this many frames in a row
+static constexpr float clockUpLoad{0.8f};       // Busy over 80% of the budget is full speed again
+
+#if PICO_ON_DEVICE
+// USB runs off PLL_USB and the frame alarm off the 1 MHz tick, neither notices a change.
+// clk_peri follows clk_sys, so the I2C divider is worked out again for 400 kHz. Only
+// core 0 uses the bus and it changes the clock between transfers.
+class clockHal {
+    public:
+        bool supports(uint32_t khz);
+        bool setKhz(uint32_t khz);
+        uint32_t khz();
+};
+
+bool clockHal::supports(uint32_t khz){
+    uint vco, postDiv1, postDiv2;
+    return check_sys_clock_khz(khz, &vco, &postDiv1, &postDiv2);
+}
+
+bool clockHal::setKhz(uint32_t khz){
+    if(!set_sys_clock_khz(khz, false)){
+        return false;
+    }
+    i2c_set_baudrate(I2C_PORT, 400 * 1000);
+    return true;
+}
+
+uint32_t clockHal::khz(){
+    return clock_get_hz(clk_sys) / 1000;
+}
+#else
+// Host stand-in, only remembers the frequency it was given
+class clockHal {
+    public:
+        uint32_t currentKhz{clockLevelsKhz[0]};
+        bool supports(uint32_t khz){ return true; }
+        bool setKhz(uint32_t khz){ currentKhz = khz; return true; }
+        uint32_t khz(){ return currentKhz; }
+};
+#endif
+
+class clockGovernor {
+    public:
+        clockHal hal;
+        uint8_t level{0};  // Into clockLevelsKhz
+        uint32_t changes{0};
+        std::array<uint32_t, clockLevelsKhz.size()> framesAtLevel{};
+        void init();
+        void update(uint32_t busyUs, uint32_t budgetUs, bool motion);
+        uint32_t khz();
+    private:
+        std::array<bool, clockLevelsKhz.size()> usable{};
+        uint16_t fitFrames{0};
+        void setLevel(uint8_t newLevel);
+};
+
+// main has already brought the clock up to the fastest level
+void clockGovernor::init(){
+    for(size_t l = 0; l < clockLevelsKhz.size(); l++){
+        usable[l] = hal.supports(clockLevelsKhz[l]);
+    }
+    usable[0] = true;
+    level = 0;
+}
+
+uint32_t clockGovernor::khz(){
+    return clockLevelsKhz[level];
+}
+
+void clockGovernor::setLevel(uint8_t newLevel){
+    if(hal.setKhz(clockLevelsKhz[newLevel])){
+        level = newLevel;
+        changes++;
+    } else {
+        usable[newLevel] = false;
+    }
+}
+
+// Busy time is the last frame's, measured at the current clock
+void clockGovernor::update(uint32_t busyUs, uint32_t budgetUs, bool motion){
+    framesAtLevel[level]++;
+    if(motion || busyUs > budgetUs * clockUpLoad){
+        fitFrames = 0;
+        if(level != 0){
+            setLevel(0);
+        }
+        return;
+    }
+    uint8_t next = level + 1;
+    while(next < clockLevelsKhz.size() && !usable[next]){
+        next++;
+    }
+    if(next >= clockLevelsKhz.size()){
+        return;
+    }
+    // The work is CPU bound, so its time scales with the clock period
+    uint64_t predictedUs = static_cast<uint64_t>(busyUs) * clockLevelsKhz[level] / clockLevelsKhz[next];
+    if(predictedUs < budgetUs * clockDownMargin){
+        if(++fitFrames >= clockDownFrames){
+            fitFrames = 0;
+            setLevel(next);
+        }
+    } else {
+        fitFrames = 0;
+    }
+}
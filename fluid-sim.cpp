@@ -1,137 +1,100 @@
 #include "pico/stdlib.h"
 #include "fluid-sim.h"
-#include <hardware/i2c.h>
-#include <hardware/clocks.h>
-#include "pico/multicore.h"
+#include "particle-kernels.h"
+#include "sim-snapshot.h"
+#include "clock-governor.h"
+#include "text-attractor.h"
+#include "badge-io.h"
+#if !PICO_ON_DEVICE
+#include "parallel-binning.h"
+#endif
 #include <math.h>
 #include <random>
 
-auto highResGravityField = generateGravityField(gravityField);
-int16_t x,y,z;
-
-std::pair<float, float> getGravityForceForParticle(fluidParticle& particle) {
-    // Convert particle position to high-res grid coordinates
-    float highX = particle.getX() * UPSCALE;
-    float highY = particle.getY() * UPSCALE;
+FLUID_HOT(getGravityForceForParticle) std::pair<float, float> getGravityForceForParticle(fluidParticle& particle, const quantizedGravityField& field) {
+    // Convert particle position to high-res grid coordinates, 20.12 fixed point
+    constexpr int fracBits = 12;
+    constexpr int32_t one = 1 << fracBits;
+    int32_t highX = static_cast<int32_t>(particle.getX() * (UPSCALE * one));
+    int32_t highY = static_cast<int32_t>(particle.getY() * (UPSCALE * one));
 
     // Find the surrounding grid points
-    int x0 = static_cast<int>(highX);
-    int y0 = static_cast<int>(highY);
+    int x0 = highX >> fracBits;
+    int y0 = highY >> fracBits;
     int x1 = (x0 + 1 < HIGH_X) ? x0 + 1 : x0;
     int y1 = (y0 + 1 < HIGH_Y) ? y0 + 1 : y0;
 
     // Compute interpolation weights
-    float tx = highX - x0;
-    float ty = highY - y0;
-    float sx = 1.0f - tx;
-    float sy = 1.0f - ty;
+    int32_t tx = highX & (one - 1);
+    int32_t ty = highY & (one - 1);
+    int32_t sx = one - tx;
+    int32_t sy = one - ty;
 
     // Fetch forces from the four surrounding grid points
-    auto [Fx00, Fy00] = highResGravityField[x0][y0];
-    auto [Fx10, Fy10] = highResGravityField[x1][y0];
-    auto [Fx01, Fy01] = highResGravityField[x0][y1];
-    auto [Fx11, Fy11] = highResGravityField[x1][y1];
-
-    // Bilinear interpolation
-    float Fx = sx * sy * Fx00 + tx * sy * Fx10 + sx * ty * Fx01 + tx * ty * Fx11;
-    float Fy = sx * sy * Fy00 + tx * sy * Fy10 + sx * ty * Fy01 + tx * ty * Fy11;
-
-    return {Fx, Fy};  // Return as a pair
-}
-
-void dampenParticleVelocity(fluidParticle& particle, const std::array<std::array<uint8_t, ysize>, xsize>& gravityField) {
-    // Get particle's position in the gravity field
-    int cellX = particle.getCellX();
-    int cellY = particle.getCellY();
-
-    // Ensure the particle is within bounds
-    if (cellX >= 0 && cellX < xsize && cellY >= 0 && cellY < ysize) {
-        // If inside a letter (gravityField[cellX][cellY] == 1), apply damping
-        if (gravityField[cellX][cellY]) {
-            particle.vx *= 0.995f;  // Reduce velocity by 25%
-            particle.vy *= 0.995f;
-        }
-    }
+    const auto& F00 = field.force[x0][y0];
+    const auto& F10 = field.force[x1][y0];
+    const auto& F01 = field.force[x0][y1];
+    const auto& F11 = field.force[x1][y1];
+
+    // Bilinear interpolation, along x first so every product stays within 32 bits
+    int32_t Fx0 = (sx * F00.fx + tx * F10.fx) >> fracBits;
+    int32_t Fx1 = (sx * F01.fx + tx * F11.fx) >> fracBits;
+    int32_t Fy0 = (sx * F00.fy + tx * F10.fy) >> fracBits;
+    int32_t Fy1 = (sx * F01.fy + tx * F11.fy) >> fracBits;
+    int32_t Fx = sy * Fx0 + ty * Fx1;
+    int32_t Fy = sy * Fy0 + ty * Fy1;
+
+    return {Fx * (field.scaleX / one), Fy * (field.scaleY / one)};  // Return as a pair
 }
 
-
-float getRandomFloat(float lower, float upper) {
-    static std::random_device rd;  // Seed generator
-    static std::mt19937 gen(rd()); // Mersenne Twister RNG
+float fluidWindow::randomFloat(float lower, float upper) {
     std::uniform_real_distribution<float> dist(lower, upper);
-    return dist(gen);
+    return dist(rng);
 }
 
-bool fluidCell::isSolid(){
+FLUID_HOT(fluidCell.isSolid) bool fluidCell::isSolid(){
     return state==cellStateEnum::solid;
 }
 
-bool fluidCell::isWater(){
+FLUID_HOT(fluidCell.isWater) bool fluidCell::isWater(){
     return state==cellStateEnum::water;
 }
 
-bool fluidCell::isAir(){
+FLUID_HOT(fluidCell.isAir) bool fluidCell::isAir(){
     return state==cellStateEnum::air;
 }
 
-void fluidWindow::print(){
-    //printf("\n\n\n");
-    for (size_t j = 0; j < ysize; j++){
-        for (size_t i = xsize; i > 0; i--){
-            switch (cells[i-1][j].state){
-                case cellStateEnum::solid:
-                    if(cordsToLedNumber[i-1][j]>255){
-                        ledBuffer2[cordsToLedNumber[i-1][j]-255] = 0;
-                    } else if (cordsToLedNumber[i-1][j]>0) {
-                        ledBuffer1[cordsToLedNumber[i-1][j]] = 0;
-                    }
-                    //printf("XX");
-                    break;
-                case cellStateEnum::air:
-                    if(cordsToLedNumber[i-1][j]>255){
-                        ledBuffer2[cordsToLedNumber[i-1][j]-255] = 0;
-                    } else if (cordsToLedNumber[i-1][j]>0) {
-                        ledBuffer1[cordsToLedNumber[i-1][j]] = 0;
-                    }
-                    //printf("  ");
-                    break;
-                case cellStateEnum::water:
-                    if(cordsToLedNumber[i-1][j]>255){
-                        ledBuffer2[cordsToLedNumber[i-1][j]-255] = MIN(1+4*cells[i-1][j].numberParticles,255);
-                    } else if (cordsToLedNumber[i-1][j]>0) {
-                        ledBuffer1[cordsToLedNumber[i-1][j]] = MIN(1+4*cells[i-1][j].numberParticles,255);
-                    }
-                    //printf("~~");
-                    break;
-            }
+FLUID_HOT(fluidWindow.print) void fluidWindow::print(){
+    for (size_t i = 0; i < xsize; i++){
+        for (size_t j = 0; j < ysize; j++){
+            brightness[i][j] = cells[i][j].isWater() ? MIN(1+4*cells[i][j].numberParticles,255) : 0;
         }
-        //printf("%u",j);
-        //printf("\n");
     }
+    display->show(brightness);
 }
 
-fluidCell& fluidWindow::right(fluidCell& cell){
+FLUID_HOT(fluidWindow.right) fluidCell& fluidWindow::right(fluidCell& cell){
     if(cell.x + 1 >= xsize){
         //printf("Error: Right cell out of bounds\n");
         return cells[cell.x][cell.y];
     }
     return cells[cell.x+1][cell.y];
 }
-fluidCell& fluidWindow::left(fluidCell& cell){
+FLUID_HOT(fluidWindow.left) fluidCell& fluidWindow::left(fluidCell& cell){
     if(cell.x - 1 < 0){
         //printf("Error: Left cell out of bounds\n");
         return cells[cell.x][cell.y];
     }
     return cells[cell.x-1][cell.y];
 }
-fluidCell& fluidWindow::up(fluidCell& cell){
+FLUID_HOT(fluidWindow.up) fluidCell& fluidWindow::up(fluidCell& cell){
     if(cell.y -1 < 0){
         //printf("Error: Up cell out of bounds\n");
         return cells[cell.x][cell.y];
     }
     return cells[cell.x][cell.y-1];
 }
-fluidCell& fluidWindow::down(fluidCell& cell){
+FLUID_HOT(fluidWindow.down) fluidCell& fluidWindow::down(fluidCell& cell){
     if(cell.y + 1 >= ysize){
         //printf("Error: Down cell out of bounds\n");
         return cells[cell.x][cell.y];
@@ -139,7 +102,44 @@ fluidCell& fluidWindow::down(fluidCell& cell){
     return cells[cell.x][cell.y+1];
 }
 
-void fluidParticle::setCoordinates(float newX, float newY){
+#if FLUID_COMPACT_PARTICLES
+// Rounded to nearest, truncating would drift every particle towards the origin. The
+// callers have checked the cell the float position is in, so it never rounds up out of it.
+FLUID_HOT(compactPosition) uint16_t compactPosition(float position, int cells){
+    float scaled = clamp<float>(position, 0, cells - 0.0001f) * compactPositionScale;
+    int32_t q = scaled + 0.5f;
+    if((q & (compactPositionScale - 1)) == 0 && q > static_cast<int32_t>(scaled)){
+        q--;
+    }
+    return q;
+}
+
+FLUID_HOT(fluidParticle.setCoordinates) void fluidParticle::setCoordinates(float newX, float newY){
+    x = compactPosition(newX, xsize);
+    y = compactPosition(newY, ysize);
+}
+
+FLUID_HOT(fluidParticle.getX) float fluidParticle::getX(){
+    return x * (1.0f / compactPositionScale);
+}
+
+FLUID_HOT(fluidParticle.getY) float fluidParticle::getY(){
+    return y * (1.0f / compactPositionScale);
+}
+
+FLUID_HOT(fluidParticle.getCellX) uint8_t fluidParticle::getCellX(){
+    return x / compactPositionScale;
+}
+
+FLUID_HOT(fluidParticle.getCellY) uint8_t fluidParticle::getCellY(){
+    return y / compactPositionScale;
+}
+
+FLUID_HOT(fluidParticle.getCellNumber) uint32_t fluidParticle::getCellNumber(){
+    return getCellX() + xsize*getCellY();
+}
+#else
+FLUID_HOT(fluidParticle.setCoordinates) void fluidParticle::setCoordinates(float newX, float newY){
     if(newX<0||newX>=xsize){
         //printf("X is out of bounds! Clamping it\n");
     }
@@ -153,49 +153,124 @@ void fluidParticle::setCoordinates(float newX, float newY){
     cellNumber = cellX + xsize*cellY;
 }
 
-float fluidParticle::getX(){
+FLUID_HOT(fluidParticle.getX) float fluidParticle::getX(){
     return x;
 }
 
-float fluidParticle::getY(){
+FLUID_HOT(fluidParticle.getY) float fluidParticle::getY(){
     return y;
 }
 
-uint8_t fluidParticle::getCellX(){
+FLUID_HOT(fluidParticle.getCellX) uint8_t fluidParticle::getCellX(){
     return cellX;
 }
 
-uint8_t fluidParticle::getCellY(){
+FLUID_HOT(fluidParticle.getCellY) uint8_t fluidParticle::getCellY(){
     return cellY;
 }
 
-void fluidWindow::init(){    
-    for( size_t i = 0; i < xsize; i++){
-        for( size_t j = 0; j < ysize; j++){
-            if(cordsToLedNumber[i][j]<0){
-                cells[i][j].state = cellStateEnum::solid;
-                cells[i][j].flowAllowed = 0;
-            }
-            cells[i][j].x = i;
-            cells[i][j].y = j;
-        }
+FLUID_HOT(fluidParticle.getCellNumber) uint32_t fluidParticle::getCellNumber(){
+    return cellNumber;
+}
+#endif
+
+void fluidWindow::init(){
+    init(std::random_device{}());
+}
+
+void fluidWindow::init(uint32_t seed, uint16_t particles){
+    rng.seed(seed);
+    initCells();
+    // The first particles are the fluid, the ids of the rest wait on the free list lowest first
+    liveParticles = std::min<uint16_t>(particles, numParticles);
+    freeIdCount = 0;
+    for(uint32_t id = numParticles; id-- > liveParticles;){
+        freeIds[freeIdCount++] = id;
     }
+    sleepingParticles = 0;
     // Setup the particles
     uint32_t particleId = 0;
-    printf("Init coord set\n");
-    for(auto& particle: particleArray){
+    for(auto& particle : live()){
         do{
-            particle.setCoordinates(getRandomFloat(1,xsize-1.001),getRandomFloat(1,ysize-1.001));
+            particle.setCoordinates(randomFloat(1,xsize-1.001),randomFloat(1,ysize-1.001));
             particle.vx = 0;
             particle.vy = 0;
             particle.particleId = particleId;
-            particleId++;
         } while (cells[particle.getCellX()][particle.getCellY()].isSolid());
+        particleId++;
+    }
+    if(liveParticles > 0){
+        particleArray[0].setCoordinates(5,1.1);
+    }
+    binningValid = false;
+}
+
+// The new particle starts in the spare bucket past the last cell, which is empty while the
+// index is valid, and is moved down into its cell's bucket like any other particle
+bool fluidWindow::emit(float x, float y, float vx, float vy){
+    if(freeIdCount == 0 || x < 0 || y < 0 || x >= xsize || y >= ysize || cells[int(x)][int(y)].isSolid()){
+        return false;
+    }
+    uint32_t p = liveParticles++;
+    fluidParticle& particle = particleArray[p];
+    particle.setCoordinates(x, y);
+    particle.vx = vx;
+    particle.vy = vy;
+    particle.particleId = freeIds[--freeIdCount];
+    particle.asleep = false;
+    particle.restFrames = 0;
+    if(binningValid){
+        particlePointers[p] = p;
+        particleSlot[p] = p;
+        binnedCell[p] = spareBucket;
+        moveInBinning(p, particle.getCellNumber());
+    }
+    return true;
+}
+
+// Moves the particle to the spare bucket, which puts it in the last slot, then the last
+// particle takes its place in the array so the live ones stay at the front
+void fluidWindow::absorb(uint32_t particleIndex){
+    if(particleIndex >= liveParticles){
+        return;
+    }
+    uint32_t last = liveParticles - 1;
+    if(binningValid){
+        moveInBinning(particleIndex, spareBucket);
+        if(particleIndex != last){
+            uint32_t slot = particleSlot[last];
+            particlePointers[slot] = particleIndex;
+            particleSlot[particleIndex] = slot;
+            binnedCell[particleIndex] = binnedCell[last];
+        }
     }
-    particleArray[0].setCoordinates(5,1.1);
+    fluidParticle& particle = particleArray[particleIndex];
+    sleepingParticles -= particle.asleep;
+    freeIds[freeIdCount++] = particle.particleId;
+    particle = particleArray[last];
+    liveParticles--;
 }
 
-void fluidWindow::updateDataStructures(){
+void fluidWindow::initCells(){
+    for( size_t i = 0; i < xsize; i++){
+        for( size_t j = 0; j < ysize; j++){
+            if(panel.solid[i][j]){
+                cells[i][j].state = cellStateEnum::solid;
+                cells[i][j].flowAllowed = 0;
+            }
+            cells[i][j].x = i;
+            cells[i][j].y = j;
+        }
+    }
+}
+
+FLUID_HOT(fluidWindow.rebuildBinning) void fluidWindow::rebuildBinning(){
+#if !PICO_ON_DEVICE
+    if(binningPool != nullptr && liveParticles >= parallelBinningMinParticles){
+        rebuildBinningOn(*binningPool);
+        return;
+    }
+#endif
     for(auto &colmn: cells){
         for(auto& cell: colmn){
             cell.numberParticles = 0;
@@ -209,8 +284,8 @@ void fluidWindow::updateDataStructures(){
         cell = 0;
     }
     // Update the particleCell array
-    for (auto &particle: particleArray){
-        cellParticleCount[particle.cellNumber]++;
+    for (auto &particle : live()){
+        cellParticleCount[particle.getCellNumber()]++;
     }
 
     // setup Partial sums
@@ -223,29 +298,145 @@ void fluidWindow::updateDataStructures(){
     //printf("\n");
     //printf(" E");
     // fill the particleArray
-    for (auto &particle: particleArray){
-        cellParticleCount[particle.cellNumber]--;
+    // The buckets hold indices into particleArray
+    for (uint32_t p = 0; p < liveParticles; p++){
+        auto &particle = particleArray[p];
+        cellParticleCount[particle.getCellNumber()]--;
         //printf(" E.1, x%u, y%u", particle.cellX, particle.cellY);
         //sleep_ms(1);
         cells[particle.getCellX()][particle.getCellY()].numberParticles++;
         cells[particle.getCellX()][particle.getCellY()].state = cellStateEnum::water;
-        //printf(" E.2 cellParticleCount Size %u, reading cell %lu", cellParticleCount.size(), particle.cellNumber);
+        //printf(" E.2 cellParticleCount Size %u, reading cell %lu", cellParticleCount.size(), particle.getCellNumber());
         //sleep_ms(1);
-        particlePointers[cellParticleCount[particle.cellNumber]] = particle.particleId;
+        particlePointers[cellParticleCount[particle.getCellNumber()]] = p;
+        particleSlot[p] = cellParticleCount[particle.getCellNumber()];
+        binnedCell[p] = particle.getCellNumber();
     }
     //printf(" F\n");
+    binningValid = true;
+    binning.fullRebuilds++;
+}
+
+// Moves one particle from the bucket it's indexed under to the one for cell to. The
+// buckets are contiguous, so the particle is swapped across each bucket boundary in
+// between and the boundary shifted by one, which keeps every other bucket intact. The
+// spare bucket after the last cell has no cell, emit and absorb go through it.
+FLUID_HOT(fluidWindow.moveInBinning) void fluidWindow::moveInBinning(uint32_t particleIndex, uint32_t to){
+    uint32_t from = binnedCell[particleIndex];
+
+    if(from != spareBucket){
+        fluidCell& oldCell = cells[from % xsize][from / xsize];
+        oldCell.numberParticles--;
+        if(oldCell.numberParticles == 0 && oldCell.isWater()){
+            oldCell.state = cellStateEnum::air;
+        }
+    }
+    if(to != spareBucket){
+        fluidCell& newCell = cells[to % xsize][to / xsize];
+        newCell.numberParticles++;
+        newCell.state = cellStateEnum::water;
+    }
+
+    // Swap the particle with the entry on the far edge of its bucket, then move the
+    // boundary so that slot belongs to the next bucket over
+    uint32_t slot = particleSlot[particleIndex];
+    while(from != to){
+        uint32_t edge = from < to ? cellParticleCount[from+1] - 1 : cellParticleCount[from];
+        uint32_t other = particlePointers[edge];
+        particlePointers[edge] = particleIndex;
+        particlePointers[slot] = other;
+        particleSlot[other] = slot;
+        slot = edge;
+        if(from < to){
+            cellParticleCount[++from]--;
+        } else {
+            cellParticleCount[from--]++;
+        }
+        binning.slotSwaps++;
+    }
+    particleSlot[particleIndex] = slot;
+    binnedCell[particleIndex] = to;
+    binning.particlesMoved++;
 }
 
+// Most particles stay in their cell from one frame to the next, so only the ones that
+// left it are moved. Past a point the per-move boundary shuffling costs more than
+// counting sort of everything, so a large upheaval rebuilds the index from scratch.
+FLUID_HOT(fluidWindow.updateDataStructures) void fluidWindow::updateDataStructures(){
+    uint32_t moved = 0;
+    if(binningValid){
+        for(uint32_t p = 0; p < liveParticles; p++){
+            moved += particleArray[p].getCellNumber() != binnedCell[p];
+        }
+    }
+    if(!binningValid || moved > liveParticles / fullRebinFraction){
+        rebuildBinning();
+        return;
+    }
+    for(uint32_t p = 0; p < liveParticles && moved > 0; p++){
+        if(particleArray[p].getCellNumber() != binnedCell[p]){
+            moveInBinning(p, particleArray[p].getCellNumber());
+            moved--;
+        }
+    }
+    binning.incrementalUpdates++;
+}
 
-void fluidWindow::integrateParticles(){
-    for(auto& particle : particleArray){
-        if(currentState==enumBadgeState::displayname1){
-            auto forceAtParticle = getGravityForceForParticle(particle);
+// Stores the particles in the Morton order of their cells, so the neighbours the collision
+// stencil and toGrid visit are mostly close by in memory as well. The buckets already hold
+// every particle sorted by cell, walking them in Morton order gives the new order, and
+// particleSlot can hold it because the index is rebuilt afterwards anyway. particleId moves
+// with its particle.
+void fluidWindow::reorderParticles(){
+    if(!binningValid){
+        rebuildBinning();
+    }
+    uint32_t next = 0;
+    for(uint16_t cell : mortonCells){
+        for(uint32_t slot = cellParticleCount[cell]; slot < cellParticleCount[cell+1]; slot++){
+            particleSlot[next++] = particlePointers[slot];
+        }
+    }
+    // Each cycle of the permutation is gathered through one spare particle, a slot is
+    // marked done by pointing it at itself
+    for(uint32_t start = 0; start < liveParticles; start++){
+        if(particleSlot[start] == start){
+            continue;
+        }
+        fluidParticle held = particleArray[start];
+        uint32_t to = start;
+        while(true){
+            uint32_t from = particleSlot[to];
+            particleSlot[to] = to;
+            if(from == start){
+                particleArray[to] = held;
+                break;
+            }
+            particleArray[to] = particleArray[from];
+            to = from;
+        }
+    }
+    rebuildBinning();
+    binning.reorders++;
+}
+
+// Kept out of line so each instantiation is a symbol the hot placement check can find
+template <enumBadgeState State>
+__attribute__((noinline)) void fluidWindow::integrateParticlesIn(const attractorField& attractor){
+    // Tilt is read once per frame, the same sum the loop used to do per particle
+    const float tiltDvx = 0.0039f * 20 * tiltX * timeStep;
+    const float tiltDvy = 0.0039f * 20 * tiltY * timeStep;
+    for(auto& particle : live()){
+        if(particleSleepBuilt && particle.asleep){
+            continue;
+        }
+        if constexpr(State == enumBadgeState::displayname1){
+            auto forceAtParticle = getGravityForceForParticle(particle, *attractor.force);
             particle.vx += 60*forceAtParticle.first * timeStep;
             particle.vy += 60*forceAtParticle.second * timeStep;
-        } else if(currentState==enumBadgeState::normalg){
-            particle.vy+= 0.0039f * 20 * y * timeStep;
-            particle.vx+= 0.0039f * 20 * x * timeStep;
+        } else if constexpr(State == enumBadgeState::normalg){
+            particle.vy += tiltDvy;
+            particle.vx += tiltDvx;
         }
         float currX = particle.getX();
         float currY = particle.getY();
@@ -325,7 +516,12 @@ void fluidWindow::integrateParticles(){
             if(cells[currCellX][currCellY-1].isSolid()){ particle.vy = 0.01; }
         }
         particle.setCoordinates(newX,newY);
-        if(currentState==enumBadgeState::displayname1) dampenParticleVelocity(particle, gravityField);
+        if constexpr(State == enumBadgeState::displayname1){
+            // 1 outside the name, so every particle takes the same multiply
+            float damping = (*attractor.damping)[particle.getCellX()][particle.getCellY()];
+            particle.vx *= damping;
+            particle.vy *= damping;
+        }
         if(particle.getCellX()!=oldCellX){
             particle.vx = 0;
         }
@@ -333,12 +529,40 @@ void fluidWindow::integrateParticles(){
             particle.vy = 0;
         }
     }
+}
+
+// GCC drops a section attribute on the template itself, only explicit instantiations keep it
+template FLUID_HOT(fluidWindow.integrateParticlesIn) void fluidWindow::integrateParticlesIn<enumBadgeState::zerog>(const attractorField&);
+template FLUID_HOT(fluidWindow.integrateParticlesIn) void fluidWindow::integrateParticlesIn<enumBadgeState::normalg>(const attractorField&);
+template FLUID_HOT(fluidWindow.integrateParticlesIn) void fluidWindow::integrateParticlesIn<enumBadgeState::displayname1>(const attractorField&);
+
+// The state is fixed for the frame, so each state gets its own copy of the loop with only
+// its own forcing and damping in it. Zero-g and the second name screen both just coast.
+FLUID_HOT(fluidWindow.integrateParticles) void fluidWindow::integrateParticles(){
+    // Loaded once, a name being swapped in only takes effect from the next frame
+    const attractorField& attractor = *activeAttractor.load(std::memory_order_acquire);
+    switch(state){
+        case enumBadgeState::normalg:
+            integrateParticlesIn<enumBadgeState::normalg>(attractor);
+            break;
+        case enumBadgeState::displayname1:
+            integrateParticlesIn<enumBadgeState::displayname1>(attractor);
+            break;
+        case enumBadgeState::zerog:
+        case enumBadgeState::displayname2:
+            integrateParticlesIn<enumBadgeState::zerog>(attractor);
+            break;
+    }
     updateDataStructures();
 }
 
-void fluidWindow::handleParticleCollisions(){
-    for(int iter = 0; iter < 5; iter++){
-        for( auto &particle : particleArray){
+FLUID_HOT(fluidWindow.handleParticleCollisions) void fluidWindow::handleParticleCollisions(uint8_t iterations){
+    for(int iter = 0; iter < iterations; iter++){
+        for( auto &particle : live()){
+            // A sleeping particle only gets hit, by its awake neighbours
+            if(particleSleepBuilt && particle.asleep){
+                continue;
+            }
             for( int i = particle.getCellX()-1; i <= particle.getCellX()+1; i++){
                 for( int j = particle.getCellY()-1; j <= particle.getCellY()+1; j++){
                     //printf("Checking cell (%d, %d)\n", i, j);
@@ -347,14 +571,11 @@ void fluidWindow::handleParticleCollisions(){
                         continue;
                     }
                     for(int particleOffset = std::get<0>(particleStats); particleOffset < (std::get<0>(particleStats)+std::get<1>(particleStats)); particleOffset++){
-                        if(particleOffset >= numParticles){
-                            printf("BAD PARTICLE ARRAY ACCESS: cell: %d, %d: array slot %d!\n", i, j, i + xsize*j);
-                            printf("Number of particles: %u, Particle Offset %u\n", std::get<1>(particleStats), std::get<0>(particleStats));
-                            printParticle(particle, "Is in a solid cell?");
-                            sleep_ms(100);
+                        if(particleOffset >= liveParticles){
+                            telemetry.log(telemetryEvent::badParticleSlot, i + xsize*j, particleOffset, particle.particleId);
                             continue;
                         }
-                        auto& otherParticle = particleArray[particleOffset];
+                        auto& otherParticle = particleArray[particlePointers[particleOffset]];
                         if (&particle == &otherParticle){
                             continue;
                         }
@@ -364,16 +585,102 @@ void fluidWindow::handleParticleCollisions(){
             }
         //printParticle(particle, "after collisions");
         }
+        // The next round looks up neighbours where the particles ended up
+        updateDataStructures();
+    }
+}
+
+// Pushes particles out of overfull cells, down the gradient of the excess particle density.
+// Costs one pass over the particles and one over the cells per iteration, independent of
+// how many neighbours each particle has.
+FLUID_HOT(fluidWindow.separateParticles) void fluidWindow::separateParticles(uint8_t iterations){
+    constexpr float stiffness = 0.1f;      // Cells moved per particle of excess density
+    constexpr float maxDisplacement = 0.25f;
+    for(int iter = 0; iter < iterations; iter++){
+        // Splat the particles onto the cell centres
+        for (auto &column : separationPressure) {
+            column.fill(0);
+        }
+        for (auto &particle : live()) {
+            float gx = particle.getX() - 0.5f;
+            float gy = particle.getY() - 0.5f;
+            int i = floor(gx);
+            int j = floor(gy);
+            float tx = gx - i;
+            float ty = gy - j;
+            separationPressure[i][j]     += (1-tx)*(1-ty);
+            separationPressure[i+1][j]   += tx*(1-ty);
+            separationPressure[i][j+1]   += (1-tx)*ty;
+            separationPressure[i+1][j+1] += tx*ty;
+        }
+        // Only crowding pushes, sparse cells don't pull particles in
+        for (auto &column : cells) {
+            for (auto &cell : column) {
+                float excess = separationPressure[cell.x][cell.y] - particleDensity;
+                separationPressure[cell.x][cell.y] = cell.isSolid() ? 0 : (excess > 0 ? excess : 0);
+            }
+        }
+        // Walls take the pressure of their fluid neighbours so they never attract particles
+        for (auto &column : cells) {
+            for (auto &cell : column) {
+                if (!cell.isSolid()) {
+                    continue;
+                }
+                float wallPressure = 0;
+                for (fluidCell* neighbour : {&left(cell), &right(cell), &up(cell), &down(cell)}) {
+                    if (!neighbour->isSolid()) {
+                        wallPressure = std::max(wallPressure, separationPressure[neighbour->x][neighbour->y]);
+                    }
+                }
+                separationPressure[cell.x][cell.y] = wallPressure;
+            }
+        }
+        // Move each particle down the gradient of the bilinear pressure field
+        for (auto &particle : live()) {
+            float gx = particle.getX() - 0.5f;
+            float gy = particle.getY() - 0.5f;
+            int i = floor(gx);
+            int j = floor(gy);
+            float tx = gx - i;
+            float ty = gy - j;
+            float p00 = separationPressure[i][j];
+            float p10 = separationPressure[i+1][j];
+            float p01 = separationPressure[i][j+1];
+            float p11 = separationPressure[i+1][j+1];
+            float gradX = (1-ty)*(p10 - p00) + ty*(p11 - p01);
+            float gradY = (1-tx)*(p01 - p00) + tx*(p11 - p10);
+            float dx = clamp<float>(-stiffness*gradX, -maxDisplacement, maxDisplacement);
+            float dy = clamp<float>(-stiffness*gradY, -maxDisplacement, maxDisplacement);
+            if(dx == 0 && dy == 0){
+                continue;
+            }
+            // Sleeping particles count towards the density but only a saturated push wakes them
+            if(particleSleepBuilt && particle.asleep){
+                if(fabsf(dx) < maxDisplacement && fabsf(dy) < maxDisplacement){
+                    continue;
+                }
+                particle.asleep = false;
+                particle.restFrames = 0;
+            }
+            float newX = particle.getX() + dx;
+            float newY = particle.getY() + dy;
+            if(!cells[floor(newX)][floor(newY)].isSolid()){
+                particle.setCoordinates(newX, newY);
+                particle.vx *= params.collisionDamping;
+                particle.vy *= params.collisionDamping;
+            }
+        }
+        updateDataStructures();
     }
 }
 
-std::tuple<uint16_t, uint16_t> fluidWindow::getParticleStats(uint32_t cellNumber){
-    uint8_t pointerOffset = cellParticleCount[cellNumber];
-    uint8_t numberOfParticles = cellParticleCount[cellNumber+1] - cellParticleCount[cellNumber];
+FLUID_HOT(fluidWindow.getParticleStats) std::tuple<uint16_t, uint16_t> fluidWindow::getParticleStats(uint32_t cellNumber){
+    uint16_t pointerOffset = cellParticleCount[cellNumber];
+    uint16_t numberOfParticles = cellParticleCount[cellNumber+1] - cellParticleCount[cellNumber];
     return std::make_tuple(pointerOffset, numberOfParticles);
 }
 
-void fluidWindow::checkCollision(fluidParticle& particle1, fluidParticle& particle2){
+FLUID_HOT(fluidWindow.checkCollision) void fluidWindow::checkCollision(fluidParticle& particle1, fluidParticle& particle2){
     //printf("Particle velocities: (%f, %f), (%f, %f)\n", particle1.vx, particle1.vy, particle2.vx, particle2.vy);
     
     float dx = particle1.getX() - particle2.getX();
@@ -398,10 +705,27 @@ void fluidWindow::checkCollision(fluidParticle& particle1, fluidParticle& partic
             newY+=particle1.diameter/1.41;
         }
         particle1.setCoordinates(newX,newY);
+        // Far enough apart now, and there's no direction to push them along
+        return;
     }
 
     //printf("Collision detected!\n");
     float d = sqrt(d2);
+
+    // A sleeping particle holds still like a wall unless it's hit hard enough to wake it
+    bool pinned = false;
+    if constexpr(particleSleepBuilt){
+        if(particle2.asleep){
+            float closing = ((particle2.vx - particle1.vx)*dx + (particle2.vy - particle1.vy)*dy)/d;
+            if(closing > wakeImpactSpeed){
+                particle2.asleep = false;
+                particle2.restFrames = 0;
+            } else {
+                pinned = true;
+            }
+        }
+    }
+
     float s = 0.5 * (particle1.diameter - d)/d;
     dx *= s;
     dy *= s;
@@ -411,13 +735,15 @@ void fluidWindow::checkCollision(fluidParticle& particle1, fluidParticle& partic
     float newY2 = particle2.getY() - dy;
 
     // Dampen particles that collide, 1% slower
-    particle1.vx *= 0.999;
-    particle1.vy *= 0.999;
-    particle2.vx *= 0.999;
-    particle2.vy *= 0.999;
+    particle1.vx *= params.collisionDamping;
+    particle1.vy *= params.collisionDamping;
+    if(!pinned){
+        particle2.vx *= params.collisionDamping;
+        particle2.vy *= params.collisionDamping;
+    }
 
     // If either particle would get pushed into the wall, don't half the disance since only one particle will be moved.
-    if(cells[floor(newX1)][floor(newY1)].isSolid() || cells[floor(newX2)][floor(newY2)].isSolid()){
+    if(pinned || cells[floor(newX1)][floor(newY1)].isSolid() || cells[floor(newX2)][floor(newY2)].isSolid()){
         //printf("Doubling distance!\n");
         newX1 = particle1.getX() + 2*dx;
         newY1 = particle1.getY() + 2*dy;
@@ -430,20 +756,12 @@ void fluidWindow::checkCollision(fluidParticle& particle1, fluidParticle& partic
     if(!cells[floor(newX1)][floor(newY1)].isSolid()){
         particle1.setCoordinates(newX1, newY1);
     }
-    if(!cells[floor(newX2)][floor(newY2)].isSolid()){
+    if(!pinned && !cells[floor(newX2)][floor(newY2)].isSolid()){
         particle2.setCoordinates(newX2, newY2);
     }
 }
 
-void fluidWindow::simulateParticles(){
-    integrateParticles();
-    //printf("After integration:\n");
-    //printParticles(50);
-    handleParticleCollisions();
-    //printf("After Collisions:\n");
-}
-
-void fluidWindow::makeIncompressible(uint8_t iterations) {
+FLUID_HOT(fluidWindow.makeIncompressible) void fluidWindow::makeIncompressible(uint8_t iterations) {
     for (uint8_t i = 0; i < iterations; i++) {
         for (auto &column : cells) {
             for (auto &cell : column) {
@@ -471,7 +789,7 @@ void fluidWindow::makeIncompressible(uint8_t iterations) {
 
                 float compression = cell.numberParticles - particleDensity;
                 compression = compression > 0 ? compression : 0;
-                divergence = 2*(divergence) - 1.5f*compression;    
+                divergence = 2*(divergence) - params.compressionGain*compression;    
 
                 cell.horizontalFlow += divergence * leftCell.flowAllowed / solidMultiplier;
                 rightCell.horizontalFlow -= divergence * rightCell.flowAllowed / solidMultiplier;
@@ -483,7 +801,45 @@ void fluidWindow::makeIncompressible(uint8_t iterations) {
 }
 
 
-void fluidWindow::toGrid(){
+// Mean absolute divergence over the water cells, what the pressure solve left behind
+float fluidWindow::divergenceResidual(){
+    float total = 0;
+    int waterCells = 0;
+    for (auto &column : cells) {
+        for (auto &cell : column) {
+            if (!cell.isWater()) {
+                continue;
+            }
+            float divergence = (-cell.horizontalFlow*left(cell).flowAllowed 
+                              + right(cell).horizontalFlow*right(cell).flowAllowed  
+                              - cell.verticalFlow*up(cell).flowAllowed 
+                              + down(cell).verticalFlow*down(cell).flowAllowed);
+            total += fabsf(divergence);
+            waterCells++;
+        }
+    }
+    return waterCells > 0 ? total / waterCells : 0;
+}
+
+// RMS of how many particles the water cells hold above the rest density
+float fluidWindow::clumping(){
+    float total = 0;
+    int waterCells = 0;
+    for (auto &column : cells) {
+        for (auto &cell : column) {
+            if (!cell.isWater()) {
+                continue;
+            }
+            float excess = cell.numberParticles - particleDensity;
+            excess = excess > 0 ? excess : 0;
+            total += excess*excess;
+            waterCells++;
+        }
+    }
+    return waterCells > 0 ? sqrtf(total / waterCells) : 0;
+}
+
+FLUID_HOT(fluidWindow.toGrid) void fluidWindow::toGrid(){
     // Reset grid values
     for (auto &column : cells) {
         for (auto &cell : column) {            
@@ -498,61 +854,9 @@ void fluidWindow::toGrid(){
         }
     }
 
-    for(auto& particle : particleArray){
-        // Horizontal Flow
-        uint8_t rootCellX = particle.getCellX();
-        uint8_t rootCellY = (particle.getY()-particle.getCellY()) > 0.5 ? particle.getCellY() : particle.getCellY()-1;
-        fluidCell& topLeftHori = cells[rootCellX][rootCellY];
-        fluidCell& topRightHori = right(topLeftHori);
-        fluidCell& bottomLeftHori = down(topLeftHori);
-        fluidCell& bottomRightHori = right(bottomLeftHori);
-        float dx = particle.getX() - (topLeftHori.x);
-        float sx = 1-dx;
-        float dy = particle.getY() - (topLeftHori.y + 0.5);
-        float sy = 1-dy;
-        float tlWeight = sx*sy;
-        float trWeight = dx*sy;
-        float blWeight = sx*dy;
-        float brWeight = dx*dy;
-
-        topLeftHori.horizontalFlow   += tlWeight*particle.vx;
-        topLeftHori.horizontalWeight += tlWeight;
-        topRightHori.horizontalFlow   += trWeight*particle.vx;
-        topRightHori.horizontalWeight += trWeight;
-        bottomLeftHori.horizontalFlow   += blWeight*particle.vx;
-        bottomLeftHori.horizontalWeight += blWeight;
-        bottomRightHori.horizontalFlow   += brWeight*particle.vx;
-        bottomRightHori.horizontalWeight += brWeight;
-
-        // Vertical Flow
-
-        rootCellX = (particle.getX()-particle.getCellX()) > 0.5 ? particle.getCellX() : particle.getCellX()-1;
-        rootCellY = particle.getCellY();
-        fluidCell& topLeftVert = cells[rootCellX][rootCellY];
-        fluidCell& topRightVert = right(topLeftVert);
-        fluidCell& bottomLeftVert = down(topLeftVert);
-        fluidCell& bottomRightVert = right(bottomLeftVert);
-        dx = particle.getX() - (topLeftVert.x + 0.5);
-        sx = 1-dx;
-        dy = particle.getY() - (topLeftVert.y);
-        sy = 1-dy;
-        tlWeight = sx*sy;
-        trWeight = dx*sy;
-        blWeight = sx*dy;
-        brWeight = dx*dy;
-
-        topLeftVert.verticalFlow     += tlWeight*particle.vy;
-        topLeftVert.verticalWeight   += tlWeight;
-        topRightVert.verticalFlow     += trWeight*particle.vy;
-        topRightVert.verticalWeight   += trWeight;
-        bottomLeftVert.verticalFlow     += blWeight*particle.vy;
-        bottomLeftVert.verticalWeight   += blWeight;
-        bottomRightVert.verticalFlow     += brWeight*particle.vy;
-        bottomRightVert.verticalWeight   += brWeight;
-        if(cells[particle.getCellX()][particle.getCellY()].isAir()){
-            cells[particle.getCellX()][particle.getCellY()].state = cellStateEnum::water;
-        }
-    }
+    // The stencils are reused by fromGrid, particles don't move in between
+    particleKernels.computeTransfers(particleArray.data(), transfers.data(), liveParticles);
+    particleKernels.scatterToGrid(cells, particleArray.data(), transfers.data(), liveParticles);
 
     // Restore solid cells
     for (auto &column : cells) {
@@ -575,73 +879,22 @@ void fluidWindow::toGrid(){
     }
 }
 
-void fluidWindow::fromGrid(float ratio){
-    for(auto& particle : particleArray){
-        // Horizontal Flow
-        uint8_t rootCellX = particle.getCellX();
-        uint8_t rootCellY = (particle.getY()-particle.getCellY()) > 0.5 ? particle.getCellY() : particle.getCellY()-1;
-        fluidCell& topLeftHori = cells[rootCellX][rootCellY];
-        fluidCell& topRightHori = right(topLeftHori);
-        fluidCell& bottomLeftHori = down(topLeftHori);
-        fluidCell& bottomRightHori = right(bottomLeftHori);
-        float dx = particle.getX() - (topLeftHori.x);
-        float sx = 1-dx;
-        float dy = particle.getY() - (topLeftHori.y + 0.5);
-        float sy = 1-dy;
-        float tlWeight = sx*sy;
-        float trWeight = dx*sy;
-        float blWeight = sx*dy;
-        float brWeight = dx*dy;
-        float tlValid = !topLeftHori.isSolid() ? 1 : 0;
-        float trValid = !topRightHori.isSolid() ? 1 : 0;
-        float blValid = !bottomLeftHori.isSolid() ? 1 : 0;
-        float brValid = !bottomRightHori.isSolid() ? 1 : 0;
-        float validWeight = tlValid*tlWeight + trValid*trWeight + blValid*blWeight + brValid*brWeight;
-        if(validWeight>0){
-            float picH  = (tlValid*tlWeight*topLeftHori.horizontalFlow + 
-                           trValid*trWeight*topRightHori.horizontalFlow +
-                           blValid*blWeight*bottomLeftHori.horizontalFlow + 
-                           brValid*brWeight*bottomRightHori.horizontalFlow)/validWeight;
-            float corrH = (tlValid*tlWeight*(topLeftHori.horizontalFlow-topLeftHori.prevHorizontalFlow) +
-                           trValid*trWeight*(topRightHori.horizontalFlow-topRightHori.prevHorizontalFlow) +
-                           blValid*blWeight*(bottomLeftHori.horizontalFlow-bottomLeftHori.prevHorizontalFlow) +
-                           brValid*brWeight*(bottomRightHori.horizontalFlow-bottomRightHori.prevHorizontalFlow))/validWeight;
-            float flipH = particle.vx + corrH;
-            particle.vx = flipH * ratio + picH * (1.0-ratio);
-        }
-        // Vertical Flow
-        rootCellX = (particle.getX()-particle.getCellX()) > 0.5 ? particle.getCellX() : particle.getCellX()-1;
-        rootCellY = particle.getCellY();
-        fluidCell& topLeftVert = cells[rootCellX][rootCellY];
-        fluidCell& topRightVert = right(topLeftVert);
-        fluidCell& bottomLeftVert = down(topLeftVert);
-        fluidCell& bottomRightVert = right(bottomLeftVert);
-        dx = particle.getX() - (topLeftVert.x + 0.5);
-        sx = 1-dx;
-        dy = particle.getY() - (topLeftVert.y);
-        sy = 1-dy;
-        tlWeight = sx*sy;
-        trWeight = dx*sy;
-        blWeight = sx*dy;
-        brWeight = dx*dy;
-        tlValid = !topLeftVert.isSolid() ? 1 : 0;
-        trValid = !topRightVert.isSolid() ? 1 : 0;
-        blValid = !bottomLeftVert.isSolid() ? 1 : 0;
-        brValid = !bottomRightVert.isSolid() ? 1 : 0;
-        validWeight = tlValid*tlWeight + trValid*trWeight + blValid*blWeight + brValid*brWeight;
-        if(validWeight>0){
-            float picV  = (tlValid*tlWeight*topLeftVert.verticalFlow + 
-                           trValid*trWeight*topRightVert.verticalFlow +
-                           blValid*blWeight*bottomLeftVert.verticalFlow + 
-                           brValid*brWeight*bottomRightVert.verticalFlow)/validWeight;
-            float corrV = (tlValid*tlWeight*(topLeftVert.verticalFlow-topLeftVert.prevVerticalFlow) + 
-                           trValid*trWeight*(topRightVert.verticalFlow-topRightVert.prevVerticalFlow) +
-                           blValid*blWeight*(bottomLeftVert.verticalFlow-bottomLeftVert.prevVerticalFlow) + 
-                           brValid*brWeight*(bottomRightVert.verticalFlow-bottomRightVert.prevVerticalFlow))/validWeight;
-            float flipV = particle.vy + corrV;
-            particle.vy = flipV * ratio + picV * (1.0-ratio);
+FLUID_HOT(fluidWindow.fromGrid) void fluidWindow::fromGrid(float ratio){
+    // Sleepers whose cell picked up flow wake first, the blend skips the rest
+    if constexpr(particleSleepBuilt){
+        for(auto& particle : live()){
+            if(!particle.asleep){
+                continue;
+            }
+            fluidCell& cell = cells[particle.getCellX()][particle.getCellY()];
+            if(fabsf(cell.horizontalFlow) < wakeFlowSpeed && fabsf(cell.verticalFlow) < wakeFlowSpeed){
+                continue;
+            }
+            particle.asleep = false;
+            particle.restFrames = 0;
         }
     }
+    particleKernels.blendFromGrid(cells, particleArray.data(), transfers.data(), liveParticles, ratio);
 }
 
 
@@ -650,29 +903,106 @@ void fluidWindow::fromGrid(float ratio){
 
 
 void fluidWindow::printParticles(int iter =  99999){
-    for(auto particle: particleArray){
+    for(auto particle : live()){
         if(iter--<0){break;}
-        printf("Particle id%u at (%f, %f) cell(%d, %d) with velocity (%f, %f)\n", particle.particleId, particle.getX(), particle.getY(), particle.getCellX(), particle.getCellY(), particle.vx, particle.vy);
+        printf("Particle id%u at (%f, %f) cell(%d, %d) with velocity (%f, %f)\n", particle.particleId, particle.getX(), particle.getY(), particle.getCellX(), particle.getCellY(), static_cast<float>(particle.vx), static_cast<float>(particle.vy));
+    }
+}
+
+void fluidWindow::wakeAll(){
+    for(auto& particle : live()){
+        particle.asleep = false;
+        particle.restFrames = 0;
+    }
+    sleepingParticles = 0;
+}
+
+// Puts particles to sleep once they have stayed slow and close to one spot for
+// sleepFrames frames. Tilting the badge or changing mode wakes everything.
+FLUID_HOT(fluidWindow.updateSleep) void fluidWindow::updateSleep(){
+    // Tracked even with sleep off, the clock governor watches it for motion too
+    bool moved = abs(tiltX - wakeTiltX) > wakeTiltChange || abs(tiltY - wakeTiltY) > wakeTiltChange || state != wakeState;
+    if(moved){
+        wakeTiltX = tiltX;
+        wakeTiltY = tiltY;
+        wakeState = state;
+        stillFrames = 0;
+    } else {
+        stillFrames++;
+    }
+    if(!particleSleepBuilt || !params.particleSleep){
+        if(sleepingParticles > 0){
+            wakeAll();
+        }
+        return;
+    }
+    if(moved){
+        wakeAll();
+        return;
+    }
+    sleepingParticles = 0;
+    for(auto& particle : live()){
+        if(particle.asleep){
+            sleepingParticles++;
+            continue;
+        }
+        float driftX = particle.getX() - particle.restX;
+        float driftY = particle.getY() - particle.restY;
+        if(particle.restFrames == 0
+           || particle.vx*particle.vx + particle.vy*particle.vy > sleepSpeed*sleepSpeed
+           || driftX*driftX + driftY*driftY > sleepDrift*sleepDrift){
+            // Start counting again from here
+            particle.restX = particle.getX();
+            particle.restY = particle.getY();
+            particle.restFrames = 1;
+            continue;
+        }
+        if(++particle.restFrames >= sleepFrames){
+            particle.asleep = true;
+            particle.vx = 0;
+            particle.vy = 0;
+            sleepingParticles++;
+        }
     }
 }
 
 //int testLed = 1;
-void fluidWindow::stepSim(){
+FLUID_HOT(fluidWindow.stepSim) void fluidWindow::stepSim(){
     //printf("Loop!\n");
-    simulateParticles();
+    simQuality q = params.adaptiveQuality ? quality.current() : simQuality{params.pressureIterations, params.collisionIterations};
+    quality.startStage();
+    integrateParticles();
+    if(params.reorderFrames > 0 && ++framesSinceReorder >= params.reorderFrames){
+        reorderParticles();
+        framesSinceReorder = 0;
+    }
+    quality.endStage(simStage::integrate);
+#if FLUID_DENSITY_SEPARATION
+    separateParticles(q.collisionIterations);
+#else
+    handleParticleCollisions(q.collisionIterations);
+#endif
+    quality.endStage(simStage::collisions);
     //myWindow.printParticles();
     //printf("Simulated!\n");
     toGrid();
+    quality.endStage(simStage::toGrid);
     //myWindow.printParticles();
     //printf("Particles to cells!\n");
-    makeIncompressible(40);
+    makeIncompressible(q.pressureIterations);
+    quality.endStage(simStage::pressure);
     //myWindow.printParticles();
     //printf("Incompressible!\n");   
-    fromGrid(0.9);
+    fromGrid(params.flipRatio);
+    updateSleep();
+    quality.endStage(simStage::fromGrid);
     //myWindow.printParticles();
     //printf("Cells to particles!\n");    
     //sleep_ms(10);
     print();
+    quality.endStage(simStage::render);
+    quality.endFrame();
+    moving.store(stillFrames == 0 || quality.level < maxQualityLevel, std::memory_order_release);
     //ledBuffer2[testLed] = 0;
     //testLed++;
     //if(testLed>192){
@@ -681,65 +1011,85 @@ void fluidWindow::stepSim(){
     //ledBuffer2[testLed] = 200;
     loopNumber++;
 
-    if(loopNumber == 1200){
+}
+
+#if PICO_ON_DEVICE
+fluidWindow myWindow;
+frameScheduler scheduler;
+clockGovernor governor;
+snapshotMailbox mailbox;
+ioScheduler io(scheduler.clock);
+tiltLatency latency;
+i2cBus bus(scheduler.clock);
+accelTask accel(scheduler, bus, latency);
+ledUploadTask leds(scheduler, bus, ledFrames, latency);
+housekeepingTask housekeeping(scheduler, bus, leds, accel, myWindow, governor, mailbox, io, latency);
+attractorBuilder nameBuilder;
+nameTask names(scheduler, nameBuilder);
+
+// The badge's demo loop, tilt gravity, then zero-g, then the name
+void cycleBadgeState(fluidWindow& window){
+    if(window.loopNumber == 1200){
         //gpio_put(25, 1);
-        currentState = enumBadgeState::zerog;
-    }  else if (loopNumber == 1600){
-        currentState = enumBadgeState::displayname1;
-    } else if (loopNumber == 2400){
+        window.state = enumBadgeState::zerog;
+    }  else if (window.loopNumber == 1600){
+        window.state = enumBadgeState::displayname1;
+    } else if (window.loopNumber == 2400){
         //gpio_put(25, 0);
-        currentState = enumBadgeState::normalg;
-        loopNumber = 0;
+        window.state = enumBadgeState::normalg;
+        window.loopNumber = 0;
     }
-
 }
 
-fluidWindow myWindow;
-
+// Core 1 simulates frame N+1 while core 0 uploads frame N, or on the low-latency path
+// simulates frame N from the tick's read for core 0 to upload straight after
 void periodic_task_sim() {
-    absolute_time_t next_time = make_timeout_time_ms(20);
+    // Parks this core in RAM while core 0 writes a snapshot to flash
+    flash_safe_execute_core_init();
+    uint32_t lastSnapshotFrame = 0;
     while (true) {
         //printf("In sim task!\n");
-        sleep_until(next_time);
+        uint32_t frame = scheduler.waitForFrame(frameStage::sim);
+        if(latency.lowLatency){
+            latency.waitForSample(scheduler, frame);
+        }
+        tiltStamp& stamp = myWindow.frame.stamp;
+        stamp.frame = frame;
+        stamp.sampleUs = accel.sampleUs.load(std::memory_order_acquire);
+        stamp.stepUs = time_us_32();
+        myWindow.tiltX = accel.x;
+        myWindow.tiltY = accel.y;
         myWindow.stepSim();
-        next_time = delayed_by_ms(next_time, 100/6);
+        cycleBadgeState(myWindow);
+        stamp.publishUs = time_us_32();
+        publish_led_frame(myWindow.frame);
+        latency.published(frame);
+        if(frame - lastSnapshotFrame >= snapshotIntervalFrames && myWindow.stillFrames >= snapshotStillFrames
+           && !mailbox.pending.load(std::memory_order_acquire)){
+            myWindow.save(mailbox.snapshot);
+            mailbox.pending.store(true, std::memory_order_release);
+            lastSnapshotFrame = frame;
+        }
+        scheduler.finishFrame(frameStage::sim);
     }
 }
 
+// Core 0 runs the I/O tasks, sleeping whenever none of them can make progress. The bus
+// goes first so a recovery's next edge is never held up by the tasks waiting on it.
 void periodic_task_io() {
-    int16_t oldX, oldY, oldZ;
-    oldX = 0;
-    oldY = 0;
-    oldZ = 0;
-    absolute_time_t next_time = make_timeout_time_ms(20);
+    io.add(bus);
+    io.add(accel);
+    io.add(leds);
+    io.add(housekeeping);
+    io.add(names);
     while (true) {
-        //printf("In IO task! X is %d.\n", x);
-        if(x>0){
-            gpio_put(25, 1);
-        } else {
-            gpio_put(25, 0);
-        }
-        sleep_until(next_time);
-        oldX = x;
-        oldY = y;
-        oldZ = z;
-        i2c_read_accel(x,y,z);
-        //variance = variance * 0.997 + 0.003*(abs(x-oldX) + abs(y-oldY) + abs(z-oldZ));
-        //printf("x:%d oldx:%d y:%d oldy:%d z:%d oldz:%d \n", x, oldX, y, oldY, z, oldZ);
-        //printf("variance: %f", variance);
-        //if(variance < 250){
-        //    gpio_put(21, 0);
-        //} else {
-        //    gpio_put(21, 1);
-        //}
-
-        set_all_brightness();
-        next_time = delayed_by_ms(next_time, 100/6);
+        io.step();
+        io.idle();
     }
 }
 
 int main() {
-    set_sys_clock_khz(250000, true);
+    set_sys_clock_khz(clockLevelsKhz[0], true);
 
     stdio_init_all(); // Initialize standard IO
 
@@ -757,19 +1107,53 @@ int main() {
     gpio_set_dir(21, GPIO_OUT);
     gpio_put(21, 1);
 
-    ledBuffer1[0]=0;
-    ledBuffer2[0]=0;
+    ledFrames.init();
+    governor.init();
+    if(latency.lowLatency){
+        myWindow.quality.budgetUs = lowLatencyBudgetUs;
+    }
 
 
     is31fl3733_init();
     sleep_ms(10);
     printf("Startup\n");
     sleep_ms(10);
-    myWindow.init();
+    // Resume the fluid where it was left, already settled
+    if(readSnapshot(mailbox.snapshot) && myWindow.restore(mailbox.snapshot)){
+        telemetry.log(telemetryEvent::snapshotRestored, myWindow.sleepingParticles, myWindow.loopNumber);
+    } else {
+        myWindow.init();
+    }
     printf("Init!\n");
-    //myWindow.simulateParticles();
-    set_all_brightness();
 
+    scheduler.start(20);
     multicore_launch_core1(periodic_task_sim);
     periodic_task_io();
 }
+#else
+#include "batch-runner.h"
+#include "stream-recorder.h"
+#include "pool-benchmark.h"
+
+int main(int argc, char** argv) {
+    if(argc > 1 && strcmp(argv[1], "io") == 0){
+        return runIoSimulation(argc, argv);
+    }
+    if(argc > 1 && strcmp(argv[1], "attractor") == 0){
+        return runAttractorBenchmark(argc, argv);
+    }
+    if(argc > 1 && strcmp(argv[1], "kernels") == 0){
+        return runKernelBenchmark(argc, argv);
+    }
+    if(argc > 1 && strcmp(argv[1], "binning") == 0){
+        return runBinningBenchmark(argc, argv);
+    }
+    if(argc > 1 && strcmp(argv[1], "stream") == 0){
+        return runStreamRecording(argc, argv);
+    }
+    if(argc > 1 && strcmp(argv[1], "pool") == 0){
+        return runPoolBenchmark(argc, argv);
+    }
+    return runBatch(argc, argv);
+}
+#endif
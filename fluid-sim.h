@@ -1,13 +1,39 @@
+#pragma once
 #include <array>
+#include <atomic>
 #include <tuple>
 #include <algorithm>
 #include <time.h>
+#include <random>
+#include <limits>
+#include "pico/stdlib.h"
+#if PICO_ON_DEVICE
 #include "hardware/i2c.h"
 #include "pico/multicore.h"
+#endif
 #include "gravity-fields.h"
+#include "frame-scheduler.h"
+#include "quality-controller.h"
+#include "telemetry.h"
+#include "tilt-latency.h"
 
 
 
+// Simulation kernels run from SRAM rather than through the 16 KB XIP cache
+#if FLUID_HOT_CODE_IN_RAM
+#define FLUID_HOT(name) __not_in_flash("fluid." #name)
+#else
+#define FLUID_HOT(name)
+#endif
+
+// The LED upload buffers sit in SCRATCH_Y next to the core 0 stack, so I2C traffic
+// doesn't contend with core 1 for the striped banks holding the particles and grid
+#if FLUID_IO_BUFFERS_IN_SCRATCH
+#define FLUID_IO_BUFFER(name) __scratch_y(#name)
+#else
+#define FLUID_IO_BUFFER(name)
+#endif
+
 enum class enumBadgeState {
     zerog,
     normalg,
@@ -15,34 +41,80 @@ enum class enumBadgeState {
     displayname2
 } ;
 
-static enumBadgeState currentState{enumBadgeState::normalg};
+static constexpr float timeStep = 1.0f/60.0f;
+#ifndef FLUID_NUM_PARTICLES
+#define FLUID_NUM_PARTICLES 350
+#endif
+static constexpr int numParticles{FLUID_NUM_PARTICLES};
+static_assert(numParticles <= UINT16_MAX, "particle slots are 16 bits");
+static constexpr int fullRebinFraction{4};  // Rebuild the cell index when over 1/4 of the particles changed cell
+#if !PICO_ON_DEVICE
+// Host windows with a binning pool sort full rebuilds of this many particles on its threads,
+// below it waking the pool four times costs more than the sort
+static constexpr uint32_t parallelBinningMinParticles{16384};
+class workerPool;
+#endif
+
+// A particle that stays slow and near one spot for sleepFrames frames stops being integrated
+// and collided until something disturbs it. Under a tenth of a cell per frame and within half
+// a diameter, so nothing visibly moving is frozen. The FLIP pack rarely gets that still, so
+// sleeping is off by default, and the wake limits are looser to keep sleepers from flickering.
+// Without FLUID_PARTICLE_SLEEP the sleep checks are compiled out of the per-particle loops
+// and simParams::particleSleep does nothing.
+#ifndef FLUID_PARTICLE_SLEEP
+#define FLUID_PARTICLE_SLEEP 0
+#endif
+static constexpr bool particleSleepBuilt{FLUID_PARTICLE_SLEEP != 0};
+static constexpr float sleepSpeed{6.0f};        // Cells per second
+static constexpr float sleepDrift{0.5f};        // Cells from where it came to rest
+static constexpr uint8_t sleepFrames{30};
+static constexpr float wakeImpactSpeed{40.0f};  // Closing speed of a neighbour that wakes it
+static constexpr float wakeFlowSpeed{40.0f};    // Grid flow through its cell that wakes it
+static constexpr int16_t wakeTiltChange{400};   // Raw accelerometer counts, about 0.1 g
+
+// A finished frame for every LED driver, each the first register address followed by the LEDs
+class ledFrame {
+    public:
+        ledFrame();
+        std::array<std::array<uint8_t, panel.uploadBytes>, panelDrivers> drivers{};
+        tiltStamp stamp;
+};
 
+ledFrame::ledFrame(){
+    for(size_t d = 0; d < panelDrivers; d++){
+        drivers[d][0] = panel.upload[d].firstRegister;
+    }
+}
 
-static constexpr float timeStep = 1.0f/60.0f;
-static constexpr int numParticles{350};
-static float variance = 10000;
-
-static constexpr std::array<std::array<int, ysize>, xsize> cordsToLedNumber {{ 
-    {-1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1, -1},
-    {-1, 177, 178, 179, 180, 181, 182, 183, 184, 185, 186, 187, 188, 189, 190, 191, 192, 432, 433, 434, 435, 436, 437, 438, 439, 440, 441, 442, 443,  -1,  -1,  -1,  -1, -1},
-    {-1, 161, 162, 163, 164, 165, 166, 167, 168, 169, 170, 171, 172, 173, 174, 175, 176, 416, 417, 418, 419, 420, 421, 422, 423, 424, 425, 426, 427, 428, 429,  -1,  -1, -1},
-    {-1, 145, 146, 147, 148, 149, 150, 151, 152, 153, 154, 155, 156, 157, 158, 159, 160, 400, 401, 402, 403, 404, 405, 406, 407, 408, 409, 410, 411, 412, 413, 414,  -1, -1},
-    {-1, 129, 130, 131, 132, 133, 134, 135, 136, 137, 138, 139, 140, 141, 142, 143, 144, 384, 385, 386, 387, 388, 389, 390, 391, 392, 393, 394, 395, 396, 397, 398,  -1, -1},
-    {-1, 113, 114, 115, 116, 117, 118, 119, 120, 121, 122, 123, 124, 125, 126, 127, 128, 368, 369, 370, 371, 372, 373, 374, 375, 376, 377, 378, 379, 380, 381, 382, 383, -1},
-    {-1,  97,  98,  99, 100, 101, 102, 103, 104, 105, 106, 107, 108, 109, 110, 111, 112, 352, 353, 354, 355, 356, 357, 358, 359, 360, 361, 362, 363, 364, 365, 366, 367, -1},
-    {-1,  81,  82,  83,  84,  85,  86,  87,  88,  89,  90,  91,  92,  93,  94,  95,  96, 336, 337, 338, 339, 340, 341, 342, 343, 344, 345, 346, 347, 348, 349, 350, 351, -1},
-    {-1,  65,  66,  67,  68,  69,  70,  71,  72,  73,  74,  75,  76,  77,  78,  79,  80, 320, 321, 322, 323, 324, 325, 326, 327, 328, 329, 330, 331, 332, 333, 334, 335, -1},
-    {-1,  49,  50,  51,  52,  53,  54,  55,  56,  57,  58,  59,  60,  61,  62,  63,  64, 304, 305, 306, 307, 308, 309, 310, 311, 312, 313, 314, 315, 316, 317, 318,  -1, -1},
-    {-1,  33,  34,  35,  36,  37,  38,  39,  40,  41,  42,  43,  44,  45,  46,  47,  48, 288, 289, 290, 291, 292, 293, 294, 295, 296, 297, 298, 299, 300, 301, 302,  -1, -1},
-    {-1,  17,  18,  19,  20,  21,  22,  23,  24,  25,  26,  27,  28,  29,  30,  31,  32, 272, 273, 274, 275, 276, 277, 278, 279, 280, 281, 282, 283, 284, 285,  -1,  -1, -1},
-    {-1,   1,   2,   3,   4,   5,   6,   7,   8,   9,  10,  11,  12,  13,  14,  15,  16, 256, 257, 258, 259, 260, 261, 262, 263, 264, 265, 266, 267,  -1,  -1,  -1,  -1, -1},
-    {-1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1, -1}
-}};
-
-
-
-static std::array<uint8_t, (12*16)+1> ledBuffer1{};
-static std::array<uint8_t, (12*16)+1> ledBuffer2{};
+// One brightness per grid cell, what print() renders before any display sees it
+using cellBrightness = std::array<std::array<uint8_t, ysize>, xsize>;
+
+// Where print() sends a rendered frame. The badge shows it on the LED drivers, host runs
+// can record it instead.
+class displaySink {
+    public:
+        virtual void show(const cellBrightness& cells) = 0;
+};
+
+// The IS31FL3733s, every LED cell's brightness goes to its byte of the driver uploads
+class ledFrameSink : public displaySink {
+    public:
+        ledFrameSink(ledFrame& frame) : frame(frame) {}
+        void show(const cellBrightness& cells) override;
+    private:
+        ledFrame& frame;
+};
+
+FLUID_HOT(ledFrameSink.show) void ledFrameSink::show(const cellBrightness& cells){
+    for (size_t i = 0; i < xsize; i++){
+        for (size_t j = 0; j < ysize; j++){
+            const ledSlot& slot = panel.render[i][j];
+            if(slot.driver != noLed){
+                frame.drivers[slot.driver][slot.offset] = cells[i][j];
+            }
+        }
+    }
+}
 
 template <typename T>
 constexpr T clamp(T value, T min, T max) {
@@ -75,6 +147,57 @@ class fluidCell {
         bool isAir();
 };
 
+using cellGrid = std::array<std::array<fluidCell, ysize>, xsize>;
+
+#if FLUID_COMPACT_PARTICLES
+// Particles packed into 16 bytes so several thousand fit in RAM. Positions are fixed point
+// from the grid origin and the cell is worked out from them, velocities share one scale.
+static constexpr int compactPositionScale{1024};  // LSBs per cell, a power of two
+static constexpr int compactVelocityScale{128};   // LSBs per cell per second, up to 256 cells/s
+
+static_assert(xsize * compactPositionScale <= 65536 && ysize * compactPositionScale <= 65536,
+              "compact positions must fit in 16 bits");
+
+// Stands in for a float field, reads back as a float and rounds to nearest on every write
+template <typename T, int lsbPerUnit>
+class fixedPoint {
+    public:
+        T raw{0};
+        operator float() const { return raw * (1.0f / lsbPerUnit); }
+        fixedPoint& operator=(float value){
+            float q = value * lsbPerUnit;
+            q = clamp<float>(q < 0 ? q - 0.5f : q + 0.5f, std::numeric_limits<T>::min(), std::numeric_limits<T>::max());
+            raw = static_cast<T>(q);
+            return *this;
+        }
+        fixedPoint& operator+=(float value){ return *this = static_cast<float>(*this) + value; }
+        fixedPoint& operator-=(float value){ return *this = static_cast<float>(*this) - value; }
+        fixedPoint& operator*=(float value){ return *this = static_cast<float>(*this) * value; }
+};
+
+class fluidParticle {
+    public:
+        fixedPoint<int16_t, compactVelocityScale> vx;
+        fixedPoint<int16_t, compactVelocityScale> vy;
+        fixedPoint<uint16_t, compactPositionScale> restX;
+        fixedPoint<uint16_t, compactPositionScale> restY;
+        uint16_t particleId{0};
+        bool asleep{false};
+        uint8_t restFrames{0};    // Frames in a row it has stayed near restX, restY
+        static constexpr float diameter{1};
+        void setCoordinates(float newX, float newY);
+        float getX();
+        float getY();
+        uint8_t getCellX();
+        uint8_t getCellY();
+        uint32_t getCellNumber();
+    private:
+        uint16_t x{0};
+        uint16_t y{0};
+};
+
+static_assert(sizeof(fluidParticle) == 16, "compact particles are 16 bytes");
+#else
 class fluidParticle {
     public:
         uint32_t cellNumber{0};
@@ -82,40 +205,166 @@ class fluidParticle {
         float vy{0};
         float diameter{1};  
         uint32_t particleId{0};   
+        bool asleep{false};
+        uint8_t restFrames{0};    // Frames in a row it has stayed near restX, restY
+        float restX{0};
+        float restY{0};
         void setCoordinates(float newX, float newY);
-        void setCell(uint8_t cellx, uint8_t celly);
         float getX();
         float getY();
         uint8_t getCellX();
         uint8_t getCellY();
+        uint32_t getCellNumber();
     private:   
         float x{0};
         float y{0};
         int cellX{0};
         int cellY{0};
 };
+#endif
+
+// Where a particle sits in the staggered grid, the top left cell of the horizontal and
+// vertical flow stencils and the particle's offset from each
+class particleTransfer {
+    public:
+        uint8_t horiX{0};
+        uint8_t horiY{0};
+        uint8_t vertX{0};
+        uint8_t vertY{0};
+        float horiDx{0};
+        float horiDy{0};
+        float vertDx{0};
+        float vertDy{0};
+};
 
 void printParticle(fluidParticle& particle, const char* message){
-    printf("Particle id %u at (%f, %f) with velocity (%f, %f), %s.\n", particle.particleId, particle.getX(), particle.getY(), particle.vx, particle.vy, message);
+    printf("Particle id %u at (%f, %f) with velocity (%f, %f), %s.\n", particle.particleId, particle.getX(), particle.getY(), static_cast<float>(particle.vx), static_cast<float>(particle.vy), message);
+}
+
+// How the cell index was kept up to date, summed since init
+class binningStats {
+    public:
+        uint32_t fullRebuilds{0};
+        uint32_t incrementalUpdates{0};
+        uint32_t particlesMoved{0};  // Moved between buckets without a rebuild
+        uint32_t slotSwaps{0};
+        uint32_t reorders{0};
+};
+
+// Cell numbers in Morton (Z) order, x in the even bits of the code. Particles stored in
+// this order sit near the ones in the cells around them along both axes, not just along x.
+constexpr std::array<uint16_t, xsize*ysize> makeMortonCells() {
+    std::array<uint16_t, xsize*ysize> cells = {};
+    int n = 0;
+    for (uint32_t code = 0; n < xsize*ysize; ++code) {
+        uint32_t x = 0, y = 0;
+        for (int bit = 0; bit < 16; ++bit) {
+            x |= ((code >> (2*bit)) & 1) << bit;
+            y |= ((code >> (2*bit + 1)) & 1) << bit;
+        }
+        if (x < xsize && y < ysize) {
+            cells[n++] = x + xsize*y;
+        }
+    }
+    return cells;
 }
 
+static constexpr auto mortonCells = makeMortonCells();
+
+// Tuning knobs that used to be hard-coded, each window carries its own copy
+class simParams {
+    public:
+        float flipRatio{0.9f};
+        float compressionGain{1.5f};    // How hard overfull cells push fluid out
+        float collisionDamping{0.999f}; // Velocity kept by both particles in a collision
+        bool adaptiveQuality{true};     // Let the quality controller pick the iterations
+        uint8_t pressureIterations{40}; // Used when adaptiveQuality is off
+        uint8_t collisionIterations{5};
+        bool particleSleep{false};      // Let resting particles skip the per-particle stages,
+                                        // needs FLUID_PARTICLE_SLEEP
+        uint16_t reorderFrames{0};      // Frames between Morton reorders of particleArray, 0 never.
+                                        // The RP2040 has no data cache, so only host runs gain.
+};
+
+class simSnapshot;
+class attractorField;
+
+// The particles a loop should visit, for range-for
+template <typename T>
+class particleRange {
+    public:
+        T* first;
+        T* last;
+        T* begin() const { return first; }
+        T* end() const { return last; }
+};
+
+// Past the last cell's bucket in particlePointers, where emitted and absorbed particles pass
+static constexpr uint32_t spareBucket{xsize*ysize};
+
 class fluidWindow {
     public:
         fluidWindow(){};
+        fluidWindow(const fluidWindow&) = delete;  // ledSink refers back into the window
+        fluidWindow& operator=(const fluidWindow&) = delete;
         int loopNumber = 0;
+        enumBadgeState state{enumBadgeState::normalg};
+        int16_t tiltX{0};  // Accelerometer reading that drives normal gravity
+        int16_t tiltY{0};
+        simParams params;
+        // Rest density the pressure stages aim for, set by the full pool so a drained badge
+        // doesn't squeeze what's left to the same spread
         static constexpr float particleDensity{numParticles/((xsize-2.0f)*(ysize-2.0f))};
-        std::array<std::array<fluidCell, ysize>, xsize> cells;
+        cellGrid cells;
+        // A fixed pool, particleArray[0, liveParticles) is the fluid and only that range is
+        // simulated. freeIds is a stack of the particleIds nobody has.
         std::array<fluidParticle, numParticles> particleArray;
-        std::array<uint32_t, numParticles> particlePointers;
-        std::array<uint32_t, ysize*xsize+1> cellParticleCount;
+        uint16_t liveParticles{numParticles};
+        std::array<uint16_t, numParticles> freeIds;
+        uint16_t freeIdCount{0};
+        particleRange<fluidParticle> live(){ return {particleArray.data(), particleArray.data() + liveParticles}; }
+        bool emit(float x, float y, float vx, float vy);  // False with the pool full or the cell solid
+        void absorb(uint32_t particleIndex);  // Swaps the last live particle into its place
+        std::array<uint16_t, numParticles> particlePointers;
+        std::array<particleTransfer, numParticles> transfers;
+        std::array<uint32_t, ysize*xsize+1> cellParticleCount;  // Start of each cell's bucket in particlePointers
+        std::array<uint16_t, numParticles> particleSlot;  // Where each particle sits in particlePointers
+        std::array<uint16_t, numParticles> binnedCell;    // The cell whose bucket holds each particle
+        bool binningValid{false};
+        binningStats binning;
+#if !PICO_ON_DEVICE
+        workerPool* binningPool{nullptr};  // Not owned, only one window at a time may use it
+#endif
+        uint16_t sleepingParticles{0};
+        int16_t wakeTiltX{0};  // Tilt and state the sleeping particles came to rest under
+        int16_t wakeTiltY{0};
+        enumBadgeState wakeState{enumBadgeState::normalg};
+        uint32_t stillFrames{0};  // Since the tilt or state last moved past the wake limits
+        // Set after each step when the tilt or state just moved or the quality is cut, the
+        // only thing core 0 reads of the step to decide the clock
+        std::atomic<bool> moving{true};
+        std::array<std::array<float, ysize>, xsize> separationPressure;
         uint32_t getCellNumberFromParticle(float x, float y);
         uint32_t getCellNumberFromCords(uint8_t x, uint8_t y);
         std::tuple<uint16_t, uint16_t> getParticleStats(uint32_t cellNumber);
         void print();
         void printParticles(int iter);
         void init();
+        void init(uint32_t seed, uint16_t particles = numParticles);
+        void initCells();
+        void save(simSnapshot& snapshot);
+        bool restore(const simSnapshot& snapshot);
+        float randomFloat(float lower, float upper);
+        float divergenceResidual();
+        float clumping();
         void updateDataStructures();
-        void simulateParticles();
+        void rebuildBinning();
+#if !PICO_ON_DEVICE
+        void rebuildBinningOn(workerPool& pool);  // rebuildBinning as a parallel counting sort
+#endif
+        void moveInBinning(uint32_t particleIndex, uint32_t to);
+        void reorderParticles();
+        uint16_t framesSinceReorder{0};
         fluidCell& getCell(fluidParticle& particle);
         fluidCell& getCell(uint8_t x, uint8_t y);
         fluidCell& right(fluidCell& cell);
@@ -130,26 +379,33 @@ class fluidWindow {
         void cellsToParticles(float ratio);
         void fromGrid(float ratio);
         void handleSolidCells();
-        void handleParticleCollisions();
+        void handleParticleCollisions(uint8_t iterations);
+        void separateParticles(uint8_t iterations);
         void integrateParticles();
+        template <enumBadgeState State>
+        void integrateParticlesIn(const attractorField& attractor);  // One loop per state, picked by integrateParticles
+        void wakeAll();
+        void updateSleep();
         void stepSim();
-        std::array<uint8_t,(xsize-2)*(ysize-2)-12> ledCommand{};
+        ledFrame frame;
+        cellBrightness brightness{};
+        ledFrameSink ledSink{frame};
+        displaySink* display{&ledSink};  // Gets every frame print() renders
+        qualityController quality;
+        std::minstd_rand rng;
 };
 
-std::array<std::array<uint8_t, ysize>, xsize> brigtness_array;
-
-
 // Use the updated constants from fluid-sim.h
 constexpr int GRID_X = xsize;  // 13 (X is first index)
 constexpr int GRID_Y = ysize;  // 29 (Y is second index)
 constexpr int UPSCALE = 3;     // 3x resolution increase
 constexpr int HIGH_X = GRID_X * UPSCALE;  // 39
 constexpr int HIGH_Y = GRID_Y * UPSCALE;  // 87
+constexpr float attractorStrength = 10.0f;  // Attraction strength (tweak as needed)
 
 // Computes the gravitational force at a high-resolution grid point
 constexpr std::pair<float, float> computeForceAt(int x, int y, const std::array<std::array<uint8_t, GRID_Y>, GRID_X>& gravityField) {
     float forceX = 0.0f, forceY = 0.0f;
-    constexpr float strength = 10.0f;  // Attraction strength (tweak as needed)
     
     for (int gx = 0; gx < GRID_X; ++gx) {
         for (int gy = 0; gy < GRID_Y; ++gy) {
@@ -158,7 +414,7 @@ constexpr std::pair<float, float> computeForceAt(int x, int y, const std::array<
                 float dy = (gy * UPSCALE + UPSCALE / 2) - y;
                 float dist2 = dx * dx + dy * dy + 1.0f;  // Prevent division by zero
                 float dist4 = dx * dx * dx * dx + dy * dy * dy * dy + 1.0f;
-                float forceMag = strength * gravityField[gx][gy] / dist4;  // 1 / r² falloff
+                float forceMag = attractorStrength * gravityField[gx][gy] / dist4;  // 1 / r² falloff
                 forceX += dx * forceMag;
                 forceY += dy * forceMag;
             }
@@ -181,134 +437,100 @@ constexpr auto generateGravityField(const std::array<std::array<uint8_t, GRID_Y>
     return output;
 }
 
-#define I2C_PORT i2c1
-#define SDA_PIN  2
-#define SCL_PIN  3
-#define CHIP_1 0b1010011  // Default I2C address
-#define CHIP_2 0b1010000  // Default I2C address
-
-void recover_i2c_bus() {
-    gpio_set_function(SCL_PIN, GPIO_FUNC_SIO); // Switch SCL to GPIO mode
-    gpio_set_function(SDA_PIN, GPIO_FUNC_SIO); // Switch SDA to GPIO mode
-
-    gpio_set_dir(SCL_PIN, GPIO_OUT);
-    gpio_set_dir(SDA_PIN, GPIO_OUT);
-
-    // Generate 9 clock pulses on SCL
-    for (int i = 0; i < 20; i++) {
-        gpio_put(SCL_PIN, 1);
-        sleep_us(10);  // Short delay
-        gpio_put(SCL_PIN, 0);
-        sleep_us(10);
-    }
+// Quantized high-res gravity field. Each force component is stored as int16 with one
+// scale per axis, so the whole table is 17 KB of flash instead of 34 KB of RAM.
+struct gravityForceSample {
+    int16_t fx;
+    int16_t fy;
+};
 
-    // Send a STOP condition to reset slaves
-    gpio_put(SDA_PIN, 1);
-    gpio_put(SCL_PIN, 1);
-    sleep_us(5);
+struct quantizedGravityField {
+    float scaleX;  // Force per LSB
+    float scaleY;
+    std::array<std::array<gravityForceSample, HIGH_Y>, HIGH_X> force;
+};
 
-    // Restore I2C functionality
-    gpio_set_function(SCL_PIN, GPIO_FUNC_I2C);
-    gpio_set_function(SDA_PIN, GPIO_FUNC_I2C);
+constexpr int16_t quantizeForce(float force, float scale) {
+    float q = force / scale;
+    return static_cast<int16_t>(q < 0 ? q - 0.5f : q + 0.5f);
 }
 
-void reset_i2c() {
-    i2c_deinit(I2C_PORT);
-    i2c_init(I2C_PORT, 400 * 1000);  // Reinitialize at 400 kHz
-}
+// Generates the quantized high-resolution gravity field at compile-time
+constexpr quantizedGravityField quantizeGravityField(const std::array<std::array<uint8_t, GRID_Y>, GRID_X>& gravityField) {
+    std::array<std::array<float, HIGH_Y>, HIGH_X> forceX = {};
+    std::array<std::array<float, HIGH_Y>, HIGH_X> forceY = {};
+    float maxX = 0.0f, maxY = 0.0f;
 
+    for (int x = 0; x < HIGH_X; ++x) {
+        for (int y = 0; y < HIGH_Y; ++y) {
+            auto force = computeForceAt(x, y, gravityField);
+            forceX[x][y] = force.first;
+            forceY[x][y] = force.second;
+            float absX = force.first < 0 ? -force.first : force.first;
+            float absY = force.second < 0 ? -force.second : force.second;
+            maxX = absX > maxX ? absX : maxX;
+            maxY = absY > maxY ? absY : maxY;
+        }
+    }
 
-void i2c_write_chip1(uint8_t reg, uint8_t value) {
-    uint8_t data[2] = {reg, value};
-    i2c_write_timeout_us(I2C_PORT, CHIP_1, data, 2, false, 1000);
-}
+    // Full int16 range maps onto the strongest force, an empty field keeps a unit scale
+    quantizedGravityField output = {};
+    output.scaleX = maxX > 0 ? maxX / 32767.0f : 1.0f;
+    output.scaleY = maxY > 0 ? maxY / 32767.0f : 1.0f;
+    for (int x = 0; x < HIGH_X; ++x) {
+        for (int y = 0; y < HIGH_Y; ++y) {
+            output.force[x][y].fx = quantizeForce(forceX[x][y], output.scaleX);
+            output.force[x][y].fy = quantizeForce(forceY[x][y], output.scaleY);
+        }
+    }
 
-void i2c_write_chip2(uint8_t reg, uint8_t value) {
-    uint8_t data[2] = {reg, value};
-    i2c_write_timeout_us(I2C_PORT, CHIP_2, data, 2, false, 1000);
+    return output;
 }
 
 #define LIS3DH_ADDR 0x19  // I2C address when SDO is high
 #define OUT_X_L 0x28      // First acceleration register
 
-void i2c_read_accel(int16_t &x, int16_t &y, int16_t &z) {
-    uint8_t reg = OUT_X_L | 0x80;  // Set MSB to enable auto-increment
-    uint8_t data[6];  // Buffer for X, Y, Z (low & high bytes)
+#if PICO_ON_DEVICE
+#define I2C_PORT i2c1
+#define SDA_PIN  2
+#define SCL_PIN  3
 
-    // Write the register address
-    if (i2c_write_timeout_us(I2C_PORT, LIS3DH_ADDR, &reg, 1, false, 1000) == PICO_ERROR_TIMEOUT) {
-        printf("I2C write failed\n");
-        recover_i2c_bus();
-        reset_i2c();
-        return;
-    }
+void reset_i2c() {
+    i2c_deinit(I2C_PORT);
+    i2c_init(I2C_PORT, 400 * 1000);  // Reinitialize at 400 kHz
+}
 
-    // Read 6 bytes (X_L, X_H, Y_L, Y_H, Z_L, Z_H)
-    if (i2c_read_timeout_us(I2C_PORT, LIS3DH_ADDR, data, 6, false, 1000) == PICO_ERROR_TIMEOUT) {
-        printf("I2C read failed\n");
-        recover_i2c_bus();
-        reset_i2c();
-        return;
-    }
 
-    // Convert to 16-bit signed values
-    y = -(int16_t)(data[1] << 8 | data[0]);
-    x = -(int16_t)(data[3] << 8 | data[2]);
-    z = (int16_t)(data[5] << 8 | data[4]);
+void i2c_write_driver(const driverUpload& driver, uint8_t reg, uint8_t value) {
+    uint8_t data[2] = {reg, value};
+    i2c_write_timeout_us(I2C_PORT, driver.address, data, 2, false, 1000);
 }
 
+void is31fl3733_init() {
+    for(const auto& driver : panel.upload){
+        // Select function page
+        i2c_write_driver(driver, 0xFE, 0xC5);
+        i2c_write_driver(driver, 0xFD, 0x03);
 
+        // Set Global Current Control Register
+        i2c_write_driver(driver, 0x01, 0x80);
 
-void is31fl3733_init() {
-    // Select function page
-    i2c_write_chip1(0xFE, 0xC5);
-    i2c_write_chip1(0xFD, 0x03);
-    i2c_write_chip2(0xFE, 0xC5);
-    i2c_write_chip2(0xFD, 0x03);
-
-
-    // Set Global Current Control Register
-    i2c_write_chip1(0x01, 0x80);
-    i2c_write_chip2(0x01, 0x80);
-
-    // Set Enable chip
-    i2c_write_chip1(0x00, 0x01);
-    i2c_write_chip2(0x00, 0x01);
-
-    // Select LED control Register Page
-    i2c_write_chip1(0xFE, 0xC5);
-    i2c_write_chip1(0xFD, 0x00);
-    i2c_write_chip2(0xFE, 0xC5);
-    i2c_write_chip2(0xFD, 0x00);
-
-    // Enable all installed LEDs on Chip 1
-    for(int i = 0; i < 12; i++){
-        i2c_write_chip1(2*i, 0xFF);
-        i2c_write_chip1(2*i + 1, 0xFF);
-    }
+        // Set Enable chip
+        i2c_write_driver(driver, 0x00, 0x01);
+
+        // Select LED control Register Page
+        i2c_write_driver(driver, 0xFE, 0xC5);
+        i2c_write_driver(driver, 0xFD, 0x00);
+
+        // Enable the LEDs the layout has on this driver
+        for(int reg = 0; reg < driverEnableRegisters; reg++){
+            i2c_write_driver(driver, reg, driver.ledEnable[reg]);
+        }
 
-    // Enable all full rows on Chip 2
-    for(int i = 0; i < 12; i++){
-        i2c_write_chip2(2*i, 0xFF);
+        // Select page 1
+        i2c_write_driver(driver, 0xFE, 0xC5);
+        i2c_write_driver(driver, 0xFD, 0x01);
     }
-    i2c_write_chip2(1, 0x0F);
-    i2c_write_chip2(3, 0x3F);
-    i2c_write_chip2(5, 0x7F);
-    i2c_write_chip2(7, 0x7F);
-    i2c_write_chip2(9, 0xFF);
-    i2c_write_chip2(11, 0xFF);
-    i2c_write_chip2(13, 0xFF);
-    i2c_write_chip2(15, 0xFF);
-    i2c_write_chip2(17, 0x7F);
-    i2c_write_chip2(19, 0x7F);
-    i2c_write_chip2(21, 0x3F);
-    i2c_write_chip2(23, 0x0F);
-
-    // Select page 1
-    i2c_write_chip1(0xFE, 0xC5);
-    i2c_write_chip1(0xFD, 0x01);  
-    i2c_write_chip2(0xFE, 0xC5);
-    i2c_write_chip2(0xFD, 0x01);  
 
     // Enable accelerometer
     uint8_t data[2] = {0x20, 0x57};  // Normal power mode, all axes enabled
@@ -319,17 +541,12 @@ void is31fl3733_init() {
     i2c_write_timeout_us(I2C_PORT, LIS3DH_ADDR, data, 2, false, 1000);
 }
 
-void set_all_brightness(){
-    if(i2c_write_timeout_us(I2C_PORT, CHIP_1, ledBuffer1.data(), sizeof(ledBuffer1), false, 10000) == PICO_ERROR_TIMEOUT){
-        printf("LED DRIVER WRITE TIMEOUT!!!\n");
-        sleep_ms(1);
-        recover_i2c_bus();
-        reset_i2c();
-    };
-    if(i2c_write_timeout_us(I2C_PORT, CHIP_2, ledBuffer2.data(), sizeof(ledBuffer2), false, 10000) == PICO_ERROR_TIMEOUT){
-        printf("LED DRIVER WRITE TIMEOUT!!!\n");
-        sleep_ms(1);
-        recover_i2c_bus();
-        reset_i2c();
-    };
+// Rendered by core 1, uploaded by core 0
+static tripleBuffer<ledFrame> FLUID_IO_BUFFER(ledFrames) ledFrames;
+
+void publish_led_frame(const ledFrame& frame){
+    ledFrames.back() = frame;
+    ledFrames.publish();
 }
+
+#endif
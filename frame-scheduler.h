@@ -0,0 +1,235 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <utility>
+#include "pico/stdlib.h"
+#include "pico/critical_section.h"
+#include "hardware/sync.h"
+#include "telemetry.h"
+
+// Both cores are driven from one frame timebase. On the device a single hardware alarm
+// ticks at exactly 60 Hz, on the host the same scheduler steps a simulated clock.
+//
+// Frame N is uploaded by core 0 while core 1 simulates frame N+1, the finished frames
+// are handed over through a triple buffer so neither side ever waits on the other.
+
+static constexpr uint32_t framesPerSecond{60};
+static constexpr int jitterBins{16};
+
+enum class frameStage {
+    sim,
+    io
+};
+
+class frameStageStats {
+    public:
+        uint32_t frames{0};
+        uint32_t overruns{0};       // Stage finished after the next frame's deadline
+        uint32_t droppedFrames{0};  // Frame ticks that passed without the stage running
+        uint32_t worstBusyUs{0};
+        uint32_t busyUs{0};   // Of the latest frame
+        int32_t slackUs{0};   // Deadline minus finish time of the latest frame
+        // Wake-up latency after the deadline, bin 0 is < 1 us, bin k is [2^(k-1), 2^k) us
+        std::array<uint32_t, jitterBins> jitter{};
+        void recordJitter(uint64_t latencyUs);
+};
+
+void frameStageStats::recordJitter(uint64_t latencyUs){
+    int bin = 0;
+    while(latencyUs > 0 && bin < jitterBins-1){
+        latencyUs >>= 1;
+        bin++;
+    }
+    jitter[bin]++;
+}
+
+#if PICO_ON_DEVICE
+class frameClock {
+    public:
+        uint64_t nowUs(){ return time_us_64(); }
+};
+#else
+// Host stand-in, time only moves when a stage reports its cost or waits for a frame
+class frameClock {
+    public:
+        uint64_t simulatedUs{0};
+        uint64_t nowUs(){ return simulatedUs; }
+        void advanceUs(uint64_t us){ simulatedUs += us; }
+};
+#endif
+
+class frameScheduler {
+    public:
+        frameClock clock;
+        void start(uint32_t firstFrameDelayMs);
+        uint64_t deadlineUs(uint32_t frame);
+        uint32_t currentFrame();
+        uint32_t waitForFrame(frameStage stage);
+        void finishFrame(frameStage stage);
+        frameStageStats& stats(frameStage stage);
+        void logStats();
+    private:
+        uint64_t startUs{0};
+        std::atomic<uint32_t> tick{0};
+        std::array<uint32_t, 2> lastFrame{};
+        std::array<uint64_t, 2> wakeUs{};
+        std::array<frameStageStats, 2> stageStats{};
+        uint32_t nextTick(int s);
+#if PICO_ON_DEVICE
+        static int64_t alarmCallback(alarm_id_t id, void* userData);
+#endif
+};
+
+// Frame deadlines are computed from the start time so the 16.67 ms period never drifts
+uint64_t frameScheduler::deadlineUs(uint32_t frame){
+    return startUs + (static_cast<uint64_t>(frame) * 1000000) / framesPerSecond;
+}
+
+frameStageStats& frameScheduler::stats(frameStage stage){
+    return stageStats[static_cast<int>(stage)];
+}
+
+#if PICO_ON_DEVICE
+int64_t frameScheduler::alarmCallback(alarm_id_t id, void* userData){
+    auto* scheduler = static_cast<frameScheduler*>(userData);
+    uint32_t frame = scheduler->tick.load(std::memory_order_relaxed) + 1;
+    scheduler->tick.store(frame, std::memory_order_release);
+    __sev();
+    // Negative means relative to when this alarm was due, so latency never accumulates
+    return -static_cast<int64_t>(scheduler->deadlineUs(frame) - scheduler->deadlineUs(frame-1));
+}
+
+void frameScheduler::start(uint32_t firstFrameDelayMs){
+    startUs = clock.nowUs() + firstFrameDelayMs * 1000;
+    add_alarm_at(from_us_since_boot(startUs), alarmCallback, this, true);
+}
+
+// The latest tick, without waiting for one
+uint32_t frameScheduler::currentFrame(){
+    return tick.load(std::memory_order_acquire);
+}
+
+uint32_t frameScheduler::nextTick(int s){
+    while(tick.load(std::memory_order_acquire) == lastFrame[s]){
+        __wfe();
+    }
+    return tick.load(std::memory_order_acquire);
+}
+#else
+void frameScheduler::start(uint32_t firstFrameDelayMs){
+    startUs = clock.nowUs() + firstFrameDelayMs * 1000;
+}
+
+// Tick N is due at deadlineUs(N-1)
+uint32_t frameScheduler::currentFrame(){
+    uint64_t now = clock.nowUs();
+    if(now < startUs){
+        return 0;
+    }
+    uint32_t frame = (now - startUs) * framesPerSecond / 1000000;
+    while(deadlineUs(frame) <= now){
+        frame++;
+    }
+    return frame;
+}
+
+uint32_t frameScheduler::nextTick(int s){
+    // Skip ticks that have already passed and sleep to the next one, as the alarm would
+    uint32_t frame = lastFrame[s] + 1;
+    while(deadlineUs(frame) <= clock.nowUs()){
+        frame++;
+    }
+    if(deadlineUs(frame-1) > clock.nowUs()){
+        clock.simulatedUs = deadlineUs(frame-1);
+    }
+    tick.store(frame);
+    return frame;
+}
+#endif
+
+// Tick N fires at deadlineUs(N-1), the stage has until deadlineUs(N) to finish
+uint32_t frameScheduler::waitForFrame(frameStage stage){
+    int s = static_cast<int>(stage);
+    uint32_t frame = nextTick(s);
+    frameStageStats& st = stageStats[s];
+    if(lastFrame[s] != 0 && frame > lastFrame[s] + 1){
+        st.droppedFrames += frame - lastFrame[s] - 1;
+    }
+    lastFrame[s] = frame;
+    wakeUs[s] = clock.nowUs();
+    st.recordJitter(wakeUs[s] - deadlineUs(frame-1));
+    return frame;
+}
+
+void frameScheduler::finishFrame(frameStage stage){
+    int s = static_cast<int>(stage);
+    frameStageStats& st = stageStats[s];
+    uint64_t now = clock.nowUs();
+    uint32_t busyUs = now - wakeUs[s];
+    st.frames++;
+    st.busyUs = busyUs;
+    st.slackUs = static_cast<int64_t>(deadlineUs(lastFrame[s])) - static_cast<int64_t>(now);
+    st.worstBusyUs = busyUs > st.worstBusyUs ? busyUs : st.worstBusyUs;
+    if(now > deadlineUs(lastFrame[s])){
+        st.overruns++;
+    }
+}
+
+void frameScheduler::logStats(){
+    for(uint16_t s = 0; s < 2; s++){
+        frameStageStats& st = stageStats[s];
+        telemetry.log(telemetryEvent::stageFrames, s, st.frames, st.overruns);
+        telemetry.log(telemetryEvent::stageTiming, s, st.droppedFrames, st.worstBusyUs);
+        // Two histogram bins per record, the stage in the high byte
+        for(uint16_t bin = 0; bin < jitterBins; bin += 2){
+            telemetry.log(telemetryEvent::stageJitter, s << 8 | bin, st.jitter[bin], st.jitter[bin+1]);
+        }
+    }
+}
+
+// Hands finished frames from the producer core to the consumer core. The producer always
+// has a free slot to write and the consumer always reads the newest complete frame.
+template <typename T>
+class tripleBuffer {
+    public:
+        void init();
+        T& back();
+        void publish();
+        const T& acquire();
+    private:
+        std::array<T, 3> slots{};
+        uint8_t frontSlot{0};
+        uint8_t middleSlot{1};
+        uint8_t backSlot{2};
+        bool fresh{false};
+        critical_section_t lock;
+};
+
+template <typename T>
+void tripleBuffer<T>::init(){
+    critical_section_init(&lock);
+}
+
+template <typename T>
+T& tripleBuffer<T>::back(){
+    return slots[backSlot];
+}
+
+template <typename T>
+void tripleBuffer<T>::publish(){
+    critical_section_enter_blocking(&lock);
+    std::swap(backSlot, middleSlot);
+    fresh = true;
+    critical_section_exit(&lock);
+}
+
+template <typename T>
+const T& tripleBuffer<T>::acquire(){
+    critical_section_enter_blocking(&lock);
+    if(fresh){
+        std::swap(frontSlot, middleSlot);
+        fresh = false;
+    }
+    critical_section_exit(&lock);
+    return slots[frontSlot];
+}
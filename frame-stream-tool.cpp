@@ -0,0 +1,177 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "frame-stream.h"
+
+// Host tool for the frame streams the simulator records
+//
+//   frame-stream-tool info [stream]
+//   frame-stream-tool pgm [stream] [output prefix] [scale]   one PGM image per frame
+//   frame-stream-tool y4m [stream] [output file] [scale]     greyscale video, "-" for stdout
+//   frame-stream-tool diff [stream] [other stream] [tolerance]
+//
+// Images have a row per x and a column per y, the way the grid is stored, each cell
+// drawn as a scale by scale block. Cells without an LED are black. diff prints every
+// frame where a cell differs by more than the tolerance and exits with 1 if any does.
+
+static constexpr int defaultScale{8};
+
+bool openStream(frameStreamReader& reader, const char* path){
+    if(!reader.open(path)){
+        fprintf(stderr, "Can't read a frame stream from %s\n", path);
+        return false;
+    }
+    return true;
+}
+
+// False if the stream stopped at a damaged frame rather than at its end
+bool finishStream(const frameStreamReader& reader, const char* path){
+    if(reader.damaged){
+        fprintf(stderr, "%s is damaged after frame %lu\n", path, (unsigned long)reader.frames);
+        return false;
+    }
+    return true;
+}
+
+void scaleFrame(const frameStreamHeader& header, const std::vector<uint8_t>& cells, int scale, std::vector<uint8_t>& image){
+    size_t width = header.ysize * scale;
+    size_t height = header.xsize * scale;
+    image.resize(width * height);
+    for(size_t row = 0; row < height; row++){
+        for(size_t column = 0; column < width; column++){
+            image[row * width + column] = cells[(row / scale) * header.ysize + column / scale];
+        }
+    }
+}
+
+int info(int argc, char** argv){
+    frameStreamReader reader;
+    if(argc < 3 || !openStream(reader, argv[2])){
+        return 1;
+    }
+    std::vector<uint8_t> cells;
+    uint64_t lit = 0;
+    while(reader.read(cells)){
+        for(uint8_t value : cells){
+            lit += value > 0;
+        }
+    }
+    const frameStreamHeader& header = reader.header;
+    printf("%u x %u cells, %lu LEDs, %u fps, key frame every %u\n", header.xsize, header.ysize,
+           (unsigned long)header.leds(), header.framesPerSecond, header.keyInterval);
+    printf("%lu frames, %.1f s, %.1f LEDs lit on average\n", (unsigned long)reader.frames,
+           reader.frames / static_cast<double>(header.framesPerSecond), reader.frames > 0 ? lit / static_cast<double>(reader.frames) : 0.0);
+    return finishStream(reader, argv[2]) ? 0 : 1;
+}
+
+int pgm(int argc, char** argv){
+    frameStreamReader reader;
+    if(argc < 4 || !openStream(reader, argv[2])){
+        return 1;
+    }
+    int scale = argc > 4 ? atoi(argv[4]) : defaultScale;
+    scale = scale > 0 ? scale : 1;
+    std::vector<uint8_t> cells, image;
+    std::vector<char> path(strlen(argv[3]) + 16);
+    while(reader.read(cells)){
+        scaleFrame(reader.header, cells, scale, image);
+        snprintf(path.data(), path.size(), "%s%06lu.pgm", argv[3], (unsigned long)reader.frames - 1);
+        FILE* out = fopen(path.data(), "wb");
+        if(!out){
+            fprintf(stderr, "Can't write %s\n", path.data());
+            return 1;
+        }
+        fprintf(out, "P5\n%d %d\n255\n", reader.header.ysize * scale, reader.header.xsize * scale);
+        fwrite(image.data(), 1, image.size(), out);
+        fclose(out);
+    }
+    fprintf(stderr, "%lu images\n", (unsigned long)reader.frames);
+    return finishStream(reader, argv[2]) ? 0 : 1;
+}
+
+// YUV4MPEG2 with only a luma plane, ffmpeg and mpv both read it
+int y4m(int argc, char** argv){
+    frameStreamReader reader;
+    if(argc < 4 || !openStream(reader, argv[2])){
+        return 1;
+    }
+    int scale = argc > 4 ? atoi(argv[4]) : defaultScale;
+    scale = scale > 0 ? scale : 1;
+    FILE* out = strcmp(argv[3], "-") == 0 ? stdout : fopen(argv[3], "wb");
+    if(!out){
+        fprintf(stderr, "Can't write %s\n", argv[3]);
+        return 1;
+    }
+    fprintf(out, "YUV4MPEG2 W%d H%d F%u:1 Ip A1:1 Cmono\n", reader.header.ysize * scale, reader.header.xsize * scale,
+            reader.header.framesPerSecond);
+    std::vector<uint8_t> cells, image;
+    while(reader.read(cells)){
+        scaleFrame(reader.header, cells, scale, image);
+        fputs("FRAME\n", out);
+        fwrite(image.data(), 1, image.size(), out);
+    }
+    if(out != stdout){
+        fclose(out);
+    }
+    fprintf(stderr, "%lu frames\n", (unsigned long)reader.frames);
+    return finishStream(reader, argv[2]) ? 0 : 1;
+}
+
+int diff(int argc, char** argv){
+    frameStreamReader a, b;
+    if(argc < 4 || !openStream(a, argv[2]) || !openStream(b, argv[3])){
+        return 1;
+    }
+    int tolerance = argc > 4 ? atoi(argv[4]) : 0;
+    if(a.header.xsize != b.header.xsize || a.header.ysize != b.header.ysize || a.header.led != b.header.led){
+        printf("layouts differ, %u x %u against %u x %u\n", a.header.xsize, a.header.ysize, b.header.xsize, b.header.ysize);
+        return 1;
+    }
+    std::vector<uint8_t> cellsA, cellsB;
+    uint32_t differing = 0;
+    bool moreA, moreB;
+    while((moreA = a.read(cellsA)) & (moreB = b.read(cellsB))){
+        size_t count = 0, worstCell = 0;
+        int worst = 0;
+        for(size_t c = 0; c < cellsA.size(); c++){
+            int delta = abs(cellsA[c] - cellsB[c]);
+            if(delta > tolerance){
+                count++;
+                if(delta > worst){
+                    worst = delta;
+                    worstCell = c;
+                }
+            }
+        }
+        if(count > 0){
+            printf("frame %lu: %lu cells differ, worst by %d at x %lu y %lu\n", (unsigned long)a.frames - 1,
+                   (unsigned long)count, worst, (unsigned long)(worstCell / a.header.ysize), (unsigned long)(worstCell % a.header.ysize));
+            differing++;
+        }
+    }
+    bool intact = finishStream(a, argv[2]) & finishStream(b, argv[3]);
+    if(moreA != moreB){
+        printf("lengths differ, %s ends after %lu frames\n", moreA ? argv[3] : argv[2], (unsigned long)(moreA ? b.frames : a.frames));
+    }
+    printf("%lu of %lu frames differ\n", (unsigned long)differing, (unsigned long)(a.frames < b.frames ? a.frames : b.frames));
+    return differing == 0 && moreA == moreB && intact ? 0 : 1;
+}
+
+int main(int argc, char** argv){
+    const char* command = argc > 1 ? argv[1] : "";
+    if(strcmp(command, "info") == 0){
+        return info(argc, argv);
+    }
+    if(strcmp(command, "pgm") == 0){
+        return pgm(argc, argv);
+    }
+    if(strcmp(command, "y4m") == 0){
+        return y4m(argc, argv);
+    }
+    if(strcmp(command, "diff") == 0){
+        return diff(argc, argv);
+    }
+    fprintf(stderr, "usage: frame-stream-tool info|pgm|y4m|diff [stream] ...\n");
+    return 1;
+}
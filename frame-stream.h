@@ -0,0 +1,281 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+// Compact stream of rendered frames for looking at the simulation off the badge. The
+// header carries the grid size and which of its cells have an LED, the frames after it
+// only hold the LED cells, in the order the grid is stored with x outermost. Each frame is
+// a list of ops that skip cells keeping their value, repeat one value or copy values
+// as they are. Key frames are coded against an all-dark frame so they decode on their
+// own, every other frame against the one before it.
+//
+//   header  "FST1", xsize, ysize, frames per second, key frame interval,
+//           one bit per cell, set for an LED, lowest bit first
+//   frame   'K' or 'D', length of the ops as u16 little endian, the ops
+//   op      0x00-0x7F  skip n+1 cells
+//           0x80-0xBF  the next byte n-0x7F times
+//           0xC0-0xFF  n-0xBF bytes follow, one per cell
+//
+// Cells past the last op keep their value. Host only, shared by the simulator and the
+// frame-stream tool.
+
+static constexpr char frameStreamMagic[4]{'F', 'S', 'T', '1'};
+static constexpr uint8_t frameStreamKey{'K'};
+static constexpr uint8_t frameStreamDelta{'D'};
+static constexpr int frameStreamMaxSkip{128};
+static constexpr int frameStreamMaxRun{64};
+static constexpr int frameStreamMinRun{3};  // Shorter runs go out as literals
+
+class frameStreamHeader {
+    public:
+        uint8_t xsize{0};
+        uint8_t ysize{0};
+        uint8_t framesPerSecond{60};
+        uint8_t keyInterval{60};  // A key frame every this many frames
+        std::vector<bool> led;    // xsize*ysize, x outermost
+        size_t cells() const { return static_cast<size_t>(xsize) * ysize; }
+        size_t leds() const;
+};
+
+size_t frameStreamHeader::leds() const {
+    size_t count = 0;
+    for(bool isLed : led){
+        count += isLed;
+    }
+    return count;
+}
+
+// Ops turning previous into current, both one value per LED
+void encodeFrameOps(const std::vector<uint8_t>& current, const std::vector<uint8_t>& previous, std::vector<uint8_t>& ops){
+    ops.clear();
+    size_t n = current.size();
+    size_t i = 0;
+    auto runAt = [&](size_t at){
+        size_t run = 1;
+        while(at + run < n && run < frameStreamMaxRun && current[at + run] == current[at]){
+            run++;
+        }
+        return run;
+    };
+    while(i < n){
+        if(current[i] == previous[i]){
+            size_t skip = 0;
+            while(i + skip < n && current[i + skip] == previous[i + skip]){
+                skip++;
+            }
+            // Nothing after the last change needs saying
+            if(i + skip == n){
+                break;
+            }
+            i += skip;
+            while(skip > 0){
+                size_t part = skip < frameStreamMaxSkip ? skip : frameStreamMaxSkip;
+                ops.push_back(part - 1);
+                skip -= part;
+            }
+            continue;
+        }
+        size_t run = runAt(i);
+        if(run >= frameStreamMinRun){
+            ops.push_back(0x80 + run - 1);
+            ops.push_back(current[i]);
+            i += run;
+            continue;
+        }
+        size_t start = i;
+        while(i < n && i - start < frameStreamMaxRun && current[i] != previous[i] && runAt(i) < frameStreamMinRun){
+            i++;
+        }
+        ops.push_back(0xC0 + (i - start) - 1);
+        ops.insert(ops.end(), current.begin() + start, current.begin() + i);
+    }
+}
+
+// False if the ops run past the frame or end in the middle of an op
+bool decodeFrameOps(const uint8_t* ops, size_t length, std::vector<uint8_t>& values){
+    size_t n = values.size();
+    size_t cell = 0;
+    size_t at = 0;
+    while(at < length){
+        uint8_t op = ops[at++];
+        if(op < 0x80){
+            cell += op + 1;
+        } else if(op < 0xC0){
+            size_t run = op - 0x7F;
+            if(at >= length || cell + run > n){
+                return false;
+            }
+            memset(&values[cell], ops[at++], run);
+            cell += run;
+        } else {
+            size_t run = op - 0xBF;
+            if(at + run > length || cell + run > n){
+                return false;
+            }
+            memcpy(&values[cell], &ops[at], run);
+            at += run;
+            cell += run;
+        }
+    }
+    return cell <= n;
+}
+
+class frameStreamWriter {
+    public:
+        ~frameStreamWriter(){ close(); }
+        bool open(const char* path, const frameStreamHeader& header);
+        bool write(const uint8_t* cells);  // Every cell of the grid, x outermost
+        void close();
+        uint32_t frames{0};
+        uint64_t bytes{0};
+    private:
+        FILE* file{nullptr};
+        frameStreamHeader header;
+        std::vector<uint8_t> current;
+        std::vector<uint8_t> previous;
+        std::vector<uint8_t> dark;
+        std::vector<uint8_t> ops;
+};
+
+bool frameStreamWriter::open(const char* path, const frameStreamHeader& header){
+    close();
+    file = fopen(path, "wb");
+    if(!file){
+        return false;
+    }
+    this->header = header;
+    size_t leds = header.leds();
+    current.assign(leds, 0);
+    previous.assign(leds, 0);
+    dark.assign(leds, 0);
+    frames = 0;
+
+    std::vector<uint8_t> bits((header.cells() + 7) / 8, 0);
+    for(size_t c = 0; c < header.cells(); c++){
+        bits[c / 8] |= header.led[c] << (c % 8);
+    }
+    uint8_t fields[4]{header.xsize, header.ysize, header.framesPerSecond, header.keyInterval};
+    fwrite(frameStreamMagic, 1, sizeof(frameStreamMagic), file);
+    fwrite(fields, 1, sizeof(fields), file);
+    fwrite(bits.data(), 1, bits.size(), file);
+    bytes = sizeof(frameStreamMagic) + sizeof(fields) + bits.size();
+    return !ferror(file);
+}
+
+bool frameStreamWriter::write(const uint8_t* cells){
+    if(!file){
+        return false;
+    }
+    size_t led = 0;
+    for(size_t c = 0; c < header.cells(); c++){
+        if(header.led[c]){
+            current[led++] = cells[c];
+        }
+    }
+    bool key = header.keyInterval <= 1 || frames % header.keyInterval == 0;
+    encodeFrameOps(current, key ? dark : previous, ops);
+    if(ops.size() > UINT16_MAX){
+        return false;
+    }
+    uint8_t record[3]{key ? frameStreamKey : frameStreamDelta, static_cast<uint8_t>(ops.size()),
+                      static_cast<uint8_t>(ops.size() >> 8)};
+    fwrite(record, 1, sizeof(record), file);
+    fwrite(ops.data(), 1, ops.size(), file);
+    bytes += sizeof(record) + ops.size();
+    frames++;
+    previous.swap(current);
+    return !ferror(file);
+}
+
+void frameStreamWriter::close(){
+    if(file){
+        fclose(file);
+        file = nullptr;
+    }
+}
+
+class frameStreamReader {
+    public:
+        ~frameStreamReader(){ close(); }
+        bool open(const char* path);
+        bool read(std::vector<uint8_t>& cells);  // False at the end or at a damaged frame
+        void close();
+        frameStreamHeader header;
+        uint32_t frames{0};
+        bool damaged{false};
+    private:
+        FILE* file{nullptr};
+        std::vector<uint8_t> values;
+        std::vector<uint8_t> ops;
+};
+
+bool frameStreamReader::open(const char* path){
+    close();
+    file = fopen(path, "rb");
+    if(!file){
+        return false;
+    }
+    char magic[4];
+    uint8_t fields[4];
+    if(fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, frameStreamMagic, sizeof(magic)) != 0
+       || fread(fields, 1, sizeof(fields), file) != sizeof(fields)){
+        close();
+        return false;
+    }
+    header.xsize = fields[0];
+    header.ysize = fields[1];
+    header.framesPerSecond = fields[2];
+    header.keyInterval = fields[3];
+    std::vector<uint8_t> bits((header.cells() + 7) / 8);
+    if(fread(bits.data(), 1, bits.size(), file) != bits.size()){
+        close();
+        return false;
+    }
+    header.led.assign(header.cells(), false);
+    for(size_t c = 0; c < header.cells(); c++){
+        header.led[c] = bits[c / 8] >> (c % 8) & 1;
+    }
+    values.assign(header.leds(), 0);
+    frames = 0;
+    damaged = false;
+    return true;
+}
+
+bool frameStreamReader::read(std::vector<uint8_t>& cells){
+    uint8_t record[3];
+    if(!file || fread(record, 1, sizeof(record), file) != sizeof(record)){
+        return false;
+    }
+    size_t length = record[1] | record[2] << 8;
+    ops.resize(length);
+    if((record[0] != frameStreamKey && record[0] != frameStreamDelta) || fread(ops.data(), 1, length, file) != length){
+        damaged = true;
+        return false;
+    }
+    if(record[0] == frameStreamKey){
+        std::fill(values.begin(), values.end(), 0);
+    }
+    if(!decodeFrameOps(ops.data(), length, values)){
+        damaged = true;
+        return false;
+    }
+    cells.assign(header.cells(), 0);
+    size_t led = 0;
+    for(size_t c = 0; c < header.cells(); c++){
+        if(header.led[c]){
+            cells[c] = values[led++];
+        }
+    }
+    frames++;
+    return true;
+}
+
+void frameStreamReader::close(){
+    if(file){
+        fclose(file);
+        file = nullptr;
+    }
+}
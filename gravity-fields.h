@@ -1,6 +1,5 @@
 #include <array>
-static constexpr int xsize{14};
-static constexpr int ysize{34};
+#include "panel-layout.h"
 
 static constexpr std::array<std::array<uint8_t, ysize>, xsize> gravityField_keno {{
     {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
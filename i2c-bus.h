@@ -0,0 +1,308 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include "pico/stdlib.h"
+#include "fluid-sim.h"
+#include "frame-scheduler.h"
+#include "io-tasks.h"
+#if PICO_ON_DEVICE
+#include "hardware/i2c.h"
+#endif
+
+// Non-blocking I2C transfers for the I/O tasks. A transfer is started and then polled
+// until it is done or has failed, the task yields in between. Tasks take turns through
+// acquire and release, the bus doesn't queue. A transfer fails once the bus has gone
+// timeoutUs without moving a byte, not after a fixed time from its start, so a core 0 busy
+// elsewhere only stretches it.
+//
+// A failed transfer hands the bus to its own recovery, which runs as a task so the
+// clock pulses and the back-off are timer waits instead of sleeps. Nobody gets the bus
+// until it is over, the tasks meanwhile carry on with what they last read or wrote.
+
+enum class busStatus {
+    busy,
+    done,
+    failed
+};
+
+static constexpr uint32_t i2cByteUs{23};  // 9 bit times at 400 kHz
+
+// Enough SCL pulses for a slave stuck mid-byte to finish it and let go of SDA
+static constexpr uint16_t recoveryPulses{20};
+static constexpr uint32_t recoveryHalfPeriodUs{10};
+static constexpr uint32_t recoveryStopUs{5};
+// Before the bus is handed out again, doubled for every failure in a row after the first
+static constexpr uint32_t recoveryBackoffUs{1000};
+static constexpr uint32_t maxRecoveryBackoffUs{64000};
+
+class i2cBus : public ioTask {
+    public:
+        i2cBus(frameClock& clock) : ioTask(clock) {}
+        bool acquire(const void* task);
+        void release(const void* task);
+        void startWrite(uint8_t address, const uint8_t* data, size_t length, uint32_t timeoutUs);
+        void startWriteRead(uint8_t address, uint8_t reg, uint8_t* out, size_t length, uint32_t timeoutUs);
+        busStatus poll();
+        uint64_t readyUs();   // When polling again is worth it
+        void recover();       // Starts a recovery after a failed transfer
+        bool recovering(){ return recoveryPending; }
+        void run() override;  // The recovery
+        uint32_t abortSource{0};  // Of the last failed transfer, 0 for a timeout
+        uint32_t recoveries{0};
+        uint16_t failuresInRow{0};
+#if !PICO_ON_DEVICE
+        // What the mock devices answer and what was sent to them
+        std::array<uint8_t, 6> readData{};
+        uint32_t transfers{0};
+        uint32_t bytes{0};
+        uint64_t busyUs{0};
+        // Fault injection, transfers faultBurst in a row out of every faultEvery time out.
+        // blockingRecovery charges the pulses to the task that failed, as they used to be.
+        uint32_t faultEvery{0};
+        uint32_t faultBurst{1};
+        uint32_t failedTransfers{0};
+        bool blockingRecovery{false};
+#endif
+    private:
+        const void* owner{nullptr};
+        bool recoveryPending{false};
+        uint16_t pulse{0};
+        uint64_t recoveryStartUs{0};
+        uint32_t backoffUs{0};
+        uint8_t address{0};
+        const uint8_t* txData{nullptr};
+        size_t txLength{0};
+        uint8_t* rxData{nullptr};
+        size_t rxLength{0};
+        uint8_t reg{0};
+        void start(uint8_t address, uint32_t timeoutUs);
+#if PICO_ON_DEVICE
+        size_t commandsSent{0};
+        size_t received{0};
+        uint32_t timeoutUs{0};
+        size_t commandsTaken{0};   // By the controller from its TX FIFO, at the last poll
+        uint64_t progressUs{0};    // Last poll that saw the bus move or waiting on us
+#else
+        uint64_t deadlineUs{0};
+        uint64_t finishUs{0};
+        bool faulted{false};
+#endif
+        void releasePins();
+        void setScl(bool high);
+        void sendStop();
+        void restorePins();
+};
+
+bool i2cBus::acquire(const void* task){
+    if(owner == nullptr && !recoveryPending){
+        owner = task;
+    }
+    return owner == task;
+}
+
+void i2cBus::release(const void* task){
+    if(owner == task){
+        owner = nullptr;
+    }
+}
+
+void i2cBus::startWrite(uint8_t address, const uint8_t* data, size_t length, uint32_t timeoutUs){
+    txData = data;
+    txLength = length;
+    rxData = nullptr;
+    rxLength = 0;
+    start(address, timeoutUs);
+}
+
+// Writes the register address, then reads length bytes after a repeated start
+void i2cBus::startWriteRead(uint8_t address, uint8_t reg, uint8_t* out, size_t length, uint32_t timeoutUs){
+    this->reg = reg;
+    txData = &this->reg;
+    txLength = 1;
+    rxData = out;
+    rxLength = length;
+    start(address, timeoutUs);
+}
+
+#if PICO_ON_DEVICE
+// Straight to the DW_apb_i2c registers, the SDK only has blocking transfers. The master
+// holds SCL low while its TX FIFO is empty, so a late refill only stretches the clock and
+// isn't counted against the timeout. Only a FIFO the controller stops taking from is.
+void i2cBus::start(uint8_t address, uint32_t timeoutUs){
+    i2c_hw_t* hw = i2c_get_hw(I2C_PORT);
+    hw->enable = 0;
+    hw->tar = address;
+    hw->enable = 1;
+    hw->clr_tx_abrt;
+    hw->clr_stop_det;
+    this->address = address;
+    commandsSent = 0;
+    received = 0;
+    commandsTaken = 0;
+    abortSource = 0;
+    this->timeoutUs = timeoutUs;
+    progressUs = clock.nowUs();
+}
+
+busStatus i2cBus::poll(){
+    i2c_hw_t* hw = i2c_get_hw(I2C_PORT);
+    size_t commands = txLength + rxLength;
+    // Before the refill, an empty FIFO with commands left means the bus was waiting on us
+    size_t queued = hw->txflr;
+    size_t taken = commandsSent - queued;
+    if(taken > commandsTaken || (queued == 0 && commandsSent < commands)){
+        commandsTaken = taken;
+        progressUs = clock.nowUs();
+    }
+    while(commandsSent < commands && i2c_get_write_available(I2C_PORT) > 0){
+        uint32_t command;
+        if(commandsSent < txLength){
+            command = txData[commandsSent];
+        } else {
+            command = I2C_IC_DATA_CMD_CMD_BITS;
+            if(commandsSent == txLength && txLength > 0){
+                command |= I2C_IC_DATA_CMD_RESTART_BITS;
+            }
+        }
+        if(++commandsSent == commands){
+            command |= I2C_IC_DATA_CMD_STOP_BITS;
+        }
+        hw->data_cmd = command;
+    }
+    while(received < rxLength && i2c_get_read_available(I2C_PORT) > 0){
+        rxData[received++] = static_cast<uint8_t>(hw->data_cmd);
+    }
+    if(hw->raw_intr_stat & I2C_IC_RAW_INTR_STAT_TX_ABRT_BITS){
+        abortSource = hw->tx_abrt_source;
+        hw->clr_tx_abrt;
+        return busStatus::failed;
+    }
+    if(commandsSent == commands && received == rxLength && (hw->raw_intr_stat & I2C_IC_RAW_INTR_STAT_STOP_DET_BITS)){
+        hw->clr_stop_det;
+        failuresInRow = 0;
+        return busStatus::done;
+    }
+    return clock.nowUs() - progressUs > timeoutUs ? busStatus::failed : busStatus::busy;
+}
+
+// A recovery in progress says when its next step is due
+uint64_t i2cBus::readyUs(){
+    return recoveryPending ? wakeUs : 0;
+}
+
+// SCL and SDA are driven by hand while the slaves are clocked free
+void i2cBus::releasePins(){
+    gpio_set_function(SCL_PIN, GPIO_FUNC_SIO);
+    gpio_set_function(SDA_PIN, GPIO_FUNC_SIO);
+    gpio_set_dir(SCL_PIN, GPIO_OUT);
+    gpio_set_dir(SDA_PIN, GPIO_OUT);
+}
+
+void i2cBus::setScl(bool high){
+    gpio_put(SCL_PIN, high);
+}
+
+void i2cBus::sendStop(){
+    gpio_put(SDA_PIN, 1);
+    gpio_put(SCL_PIN, 1);
+}
+
+void i2cBus::restorePins(){
+    gpio_set_function(SCL_PIN, GPIO_FUNC_I2C);
+    gpio_set_function(SDA_PIN, GPIO_FUNC_I2C);
+    reset_i2c();
+}
+#else
+// Host stand-in, every transfer succeeds after the time its bytes take on the wire unless
+// a fault is injected, then it hangs from its first byte like one with SDA held low and
+// fails once the timeout passes without progress
+void i2cBus::start(uint8_t address, uint32_t timeoutUs){
+    this->address = address;
+    abortSource = 0;
+    deadlineUs = clock.nowUs() + timeoutUs;
+    // The address byte, plus a second one for the repeated start of a read
+    size_t wireBytes = 1 + txLength + (rxLength > 0 ? 1 + rxLength : 0);
+    transfers++;
+    faulted = faultEvery > 0 && transfers % faultEvery < faultBurst;
+    if(faulted){
+        finishUs = deadlineUs;
+        failedTransfers++;
+        busyUs += timeoutUs;
+        return;
+    }
+    finishUs = clock.nowUs() + wireBytes * i2cByteUs;
+    bytes += wireBytes;
+    busyUs += wireBytes * i2cByteUs;
+}
+
+busStatus i2cBus::poll(){
+    if(clock.nowUs() < finishUs){
+        return busStatus::busy;
+    }
+    if(faulted){
+        return busStatus::failed;
+    }
+    for(size_t i = 0; i < rxLength; i++){
+        rxData[i] = readData[i % readData.size()];
+    }
+    failuresInRow = 0;
+    return busStatus::done;
+}
+
+uint64_t i2cBus::readyUs(){
+    return recoveryPending ? wakeUs : finishUs;
+}
+
+void i2cBus::releasePins(){
+}
+
+void i2cBus::setScl(bool high){
+}
+
+void i2cBus::sendStop(){
+}
+
+void i2cBus::restorePins(){
+}
+#endif
+
+void i2cBus::recover(){
+    failuresInRow = failuresInRow < UINT16_MAX ? failuresInRow + 1 : failuresInRow;
+#if !PICO_ON_DEVICE
+    if(blockingRecovery){
+        clock.advanceUs(2*recoveryPulses*recoveryHalfPeriodUs + recoveryStopUs);
+        recoveries++;
+        return;
+    }
+#endif
+    recoveryPending = true;
+    wakeUs = taskPoll;
+}
+
+// Waits for the task that failed to let go of the bus, then runs the old blocking
+// sequence with timer waits between the edges. Other tasks running in between only
+// stretch the clock, the slaves don't mind how slow it is.
+void i2cBus::run(){
+    TASK_BEGIN();
+    while(true){
+        // recover() wakes it
+        TASK_WAIT_UNTIL(recoveryPending && owner == nullptr, UINT64_MAX);
+        recoveryStartUs = clock.nowUs();
+        backoffUs = std::min(recoveryBackoffUs << std::min(failuresInRow - 1, 6), maxRecoveryBackoffUs);
+        releasePins();
+        for(pulse = 0; pulse < 2*recoveryPulses; pulse++){
+            setScl(pulse % 2 == 0);
+            TASK_SLEEP_UNTIL(clock.nowUs() + recoveryHalfPeriodUs);
+        }
+        sendStop();
+        TASK_SLEEP_UNTIL(clock.nowUs() + recoveryStopUs);
+        restorePins();
+        recoveries++;
+        telemetry.log(telemetryEvent::busRecovered, failuresInRow, clock.nowUs() - recoveryStartUs, backoffUs);
+        TASK_SLEEP_UNTIL(clock.nowUs() + backoffUs);
+        recoveryPending = false;
+    }
+    TASK_END();
+}
@@ -0,0 +1,116 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include "pico/stdlib.h"
+#include "frame-scheduler.h"
+
+// Cooperative tasks for core 0's I/O. Each task is a stackless coroutine in the style of
+// protothreads: run() opens with TASK_BEGIN and closes with TASK_END, and every wait
+// returns to the scheduler and resumes on the same line the next time the task runs.
+// Nothing on the stack survives a wait, so state a task needs afterwards has to live in
+// its members, and waits can't sit inside a switch of the task's own.
+
+#define TASK_BEGIN() switch(resumeLine){ case 0:
+
+// Until the condition holds, come back at untilUs, or as soon as possible with taskPoll
+#define TASK_WAIT_UNTIL(condition, untilUs) \
+    do { \
+        resumeLine = __LINE__; \
+        case __LINE__: \
+        if(!(condition)){ \
+            wakeUs = (untilUs); \
+            return; \
+        } \
+    } while(0)
+
+#define TASK_SLEEP_UNTIL(timeUs) \
+    do { \
+        sleepUntilUs = (timeUs); \
+        TASK_WAIT_UNTIL(clock.nowUs() >= sleepUntilUs, sleepUntilUs); \
+    } while(0)
+
+// Gives the other tasks a turn and carries on as soon as possible
+#define TASK_YIELD() \
+    do { \
+        resumeLine = __LINE__; \
+        wakeUs = taskPoll; \
+        return; \
+        case __LINE__:; \
+    } while(0)
+
+#define TASK_END() } resumeLine = 0; wakeUs = 0;
+
+static constexpr uint64_t taskPoll{0};
+
+class ioTask {
+    public:
+        ioTask(frameClock& clock) : clock(clock) {}
+        uint64_t wakeUs{0};  // Not worth running before this
+        virtual void run() = 0;
+    protected:
+        frameClock& clock;
+        uint32_t resumeLine{0};
+        uint64_t sleepUntilUs{0};
+};
+
+static constexpr int maxIoTasks{8};
+
+// Runs the tasks round robin in the order they were added, earlier tasks get the bus first
+class ioScheduler {
+    public:
+        ioScheduler(frameClock& clock) : clock(clock) {}
+        void add(ioTask& task);
+        void step();
+        uint64_t nextWakeUs();
+        void idle();
+        uint32_t worstRunUs{0};  // Longest any one task kept the core
+    private:
+        frameClock& clock;
+        std::array<ioTask*, maxIoTasks> tasks{};
+        uint8_t count{0};
+};
+
+void ioScheduler::add(ioTask& task){
+    if(count < maxIoTasks){
+        tasks[count++] = &task;
+    }
+}
+
+void ioScheduler::step(){
+    for(uint8_t t = 0; t < count; t++){
+        uint64_t startUs = clock.nowUs();
+        if(startUs >= tasks[t]->wakeUs){
+            tasks[t]->run();
+            uint64_t runUs = clock.nowUs() - startUs;
+            worstRunUs = runUs > worstRunUs ? runUs : worstRunUs;
+        }
+    }
+}
+
+uint64_t ioScheduler::nextWakeUs(){
+    uint64_t next = UINT64_MAX;
+    for(uint8_t t = 0; t < count; t++){
+        next = tasks[t]->wakeUs < next ? tasks[t]->wakeUs : next;
+    }
+    return next;
+}
+
+#if PICO_ON_DEVICE
+// Tasks polling the bus keep the core spinning, otherwise it waits for the frame alarm
+// or the earliest deadline
+void ioScheduler::idle(){
+    uint64_t next = nextWakeUs();
+    if(next > clock.nowUs()){
+        best_effort_wfe_or_timeout(from_us_since_boot(next));
+    }
+}
+#else
+// Host stand-in, nothing happens in between so the simulated clock jumps to the next wake
+// up. The bus reports when its transfer finishes through the waiting task's wakeUs.
+void ioScheduler::idle(){
+    uint64_t next = nextWakeUs();
+    if(next != UINT64_MAX && next > clock.nowUs()){
+        clock.simulatedUs = next;
+    }
+}
+#endif
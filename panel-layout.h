@@ -0,0 +1,245 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include "pico/stdlib.h"
+
+// Describes the LED panel the simulation runs on. Everything that used to be read off a
+// hand-typed LED number table is generated from the description at compile time: the grid
+// size, which cells are solid, where each cell's brightness goes in the I2C upload and the
+// drivers' LED enable registers. A new panel shape is a new layout and nothing else.
+
+// IS31FL3733 matrix driver, PWM register sw*16 + cs, one LED enable bit per LED
+static constexpr uint8_t driverSwPins{12};
+static constexpr uint8_t driverCsPins{16};
+static constexpr uint8_t driverEnableRegisters{driverSwPins*driverCsPins/8};
+
+class ledDriver {
+    public:
+        uint8_t address;  // 7-bit I2C address
+};
+
+// A straight run of LEDs on one switch pin, one per grid cell going along +y
+class ledRun {
+    public:
+        uint8_t driver;   // Index into the layout's drivers
+        uint8_t sw;
+        uint8_t firstCs;  // Current source pin of the first LED, the rest follow in order
+        uint8_t x;        // Grid cell of the first LED, the solid border is row and column 0
+        uint8_t y;
+        uint8_t length;
+};
+
+template <size_t Drivers, size_t Runs>
+class panelLayout {
+    public:
+        uint8_t width;   // LED cells, the grid adds a solid border all round
+        uint8_t height;
+        std::array<ledDriver, Drivers> drivers;
+        std::array<ledRun, Runs> runs;
+};
+
+// The badge, two drivers side by side along y. Grid row x is switch pin 12 - x on both,
+// the second driver's rows get shorter towards the rounded end.
+static constexpr panelLayout<2, 24> badgeLayout {12, 32, {{{0b1010011}, {0b1010000}}}, {{
+    // driver, sw, cs, x, y, length
+    {0, 11, 0,  1, 1, 16}, {1, 11, 0,  1, 17, 12},
+    {0, 10, 0,  2, 1, 16}, {1, 10, 0,  2, 17, 14},
+    {0,  9, 0,  3, 1, 16}, {1,  9, 0,  3, 17, 15},
+    {0,  8, 0,  4, 1, 16}, {1,  8, 0,  4, 17, 15},
+    {0,  7, 0,  5, 1, 16}, {1,  7, 0,  5, 17, 16},
+    {0,  6, 0,  6, 1, 16}, {1,  6, 0,  6, 17, 16},
+    {0,  5, 0,  7, 1, 16}, {1,  5, 0,  7, 17, 16},
+    {0,  4, 0,  8, 1, 16}, {1,  4, 0,  8, 17, 16},
+    {0,  3, 0,  9, 1, 16}, {1,  3, 0,  9, 17, 15},
+    {0,  2, 0, 10, 1, 16}, {1,  2, 0, 10, 17, 15},
+    {0,  1, 0, 11, 1, 16}, {1,  1, 0, 11, 17, 14},
+    {0,  0, 0, 12, 1, 16}, {1,  0, 0, 12, 17, 12}
+}}};
+
+static constexpr uint8_t noLed{0xFF};
+
+// Where a cell's brightness goes
+class ledSlot {
+    public:
+        uint8_t driver{noLed};
+        uint8_t offset{0};  // Byte in that driver's upload buffer
+};
+
+// One I2C write per driver per frame, the first register address then the PWM values
+class driverUpload {
+    public:
+        uint8_t address{0};
+        uint8_t firstRegister{0};
+        uint8_t registers{0};
+        std::array<uint8_t, driverEnableRegisters> ledEnable{};
+};
+
+template <int Width, int Height, size_t Drivers>
+class panelTables {
+    public:
+        std::array<std::array<bool, Height>, Width> solid{};
+        std::array<std::array<ledSlot, Height>, Width> render{};
+        std::array<driverUpload, Drivers> upload{};
+        uint16_t ledCount{0};
+        uint8_t uploadBytes{1};  // Largest upload buffer, register address included
+};
+
+template <int Width, int Height, size_t Drivers, size_t Runs>
+constexpr panelTables<Width, Height, Drivers> makePanelTables(const panelLayout<Drivers, Runs>& layout) {
+    panelTables<Width, Height, Drivers> tables{};
+    for (auto& column : tables.solid) {
+        for (auto& solid : column) {
+            solid = true;
+        }
+    }
+
+    // Only the registers between the lowest and highest LED of each driver are sent
+    std::array<int, Drivers> lowest{};
+    std::array<int, Drivers> highest{};
+    for (size_t d = 0; d < Drivers; d++) {
+        lowest[d] = driverSwPins*driverCsPins;
+        highest[d] = -1;
+    }
+    for (const auto& run : layout.runs) {
+        for (int k = 0; k < run.length; k++) {
+            int cs = run.firstCs + k;
+            int reg = run.sw*driverCsPins + cs;
+            lowest[run.driver] = reg < lowest[run.driver] ? reg : lowest[run.driver];
+            highest[run.driver] = reg > highest[run.driver] ? reg : highest[run.driver];
+            tables.solid[run.x][run.y + k] = false;
+            tables.upload[run.driver].ledEnable[run.sw*2 + cs/8] |= 1 << (cs%8);
+            tables.ledCount++;
+        }
+    }
+    for (size_t d = 0; d < Drivers; d++) {
+        driverUpload& upload = tables.upload[d];
+        upload.address = layout.drivers[d].address;
+        upload.firstRegister = highest[d] < 0 ? 0 : lowest[d];
+        upload.registers = highest[d] < 0 ? 0 : highest[d] - lowest[d] + 1;
+        tables.uploadBytes = 1 + upload.registers > tables.uploadBytes ? 1 + upload.registers : tables.uploadBytes;
+    }
+    for (const auto& run : layout.runs) {
+        for (int k = 0; k < run.length; k++) {
+            int reg = run.sw*driverCsPins + run.firstCs + k;
+            ledSlot& slot = tables.render[run.x][run.y + k];
+            slot.driver = run.driver;
+            slot.offset = 1 + reg - tables.upload[run.driver].firstRegister;
+        }
+    }
+    return tables;
+}
+
+// Every run on real pins and inside the panel, and no LED or cell used twice
+template <size_t Drivers, size_t Runs>
+constexpr bool layoutIsValid(const panelLayout<Drivers, Runs>& layout) {
+    for (size_t a = 0; a < Runs; a++) {
+        const ledRun& run = layout.runs[a];
+        if (run.driver >= Drivers || run.sw >= driverSwPins || run.length == 0
+            || run.firstCs + run.length > driverCsPins
+            || run.x < 1 || run.x > layout.width
+            || run.y < 1 || run.y + run.length - 1 > layout.height) {
+            return false;
+        }
+        for (size_t b = a + 1; b < Runs; b++) {
+            const ledRun& other = layout.runs[b];
+            bool pinsOverlap = run.driver == other.driver && run.sw == other.sw
+                && run.firstCs < other.firstCs + other.length && other.firstCs < run.firstCs + run.length;
+            bool cellsOverlap = run.x == other.x
+                && run.y < other.y + other.length && other.y < run.y + run.length;
+            if (pinsOverlap || cellsOverlap) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// The generated tables agree with each other
+template <int Width, int Height, size_t Drivers>
+constexpr bool tablesAreConsistent(const panelTables<Width, Height, Drivers>& tables) {
+    int leds = 0;
+    for (int x = 0; x < Width; x++) {
+        for (int y = 0; y < Height; y++) {
+            const ledSlot& slot = tables.render[x][y];
+            bool border = x == 0 || y == 0 || x == Width - 1 || y == Height - 1;
+            if ((border && !tables.solid[x][y]) || tables.solid[x][y] != (slot.driver == noLed)) {
+                return false;
+            }
+            if (slot.driver != noLed) {
+                if (slot.driver >= Drivers || slot.offset < 1 || slot.offset > tables.upload[slot.driver].registers) {
+                    return false;
+                }
+                leds++;
+            }
+        }
+    }
+    return leds == tables.ledCount;
+}
+
+// The panel this firmware is built for
+static constexpr const auto& activeLayout = badgeLayout;
+static constexpr int xsize{activeLayout.width + 2};
+static constexpr int ysize{activeLayout.height + 2};
+static constexpr size_t panelDrivers{activeLayout.drivers.size()};
+static constexpr auto panel = makePanelTables<xsize, ysize>(activeLayout);
+static_assert(layoutIsValid(activeLayout), "panel layout has overlapping or out of range runs");
+
+#if !PICO_ON_DEVICE
+// The LED numbers the badge was first brought up with, the first driver's PWM register + 1
+// or the second driver's + 256, -1 for no LED
+static constexpr std::array<std::array<int, 34>, 14> badgeLedNumbers {{
+    {-1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1, -1},
+    {-1, 177, 178, 179, 180, 181, 182, 183, 184, 185, 186, 187, 188, 189, 190, 191, 192, 432, 433, 434, 435, 436, 437, 438, 439, 440, 441, 442, 443,  -1,  -1,  -1,  -1, -1},
+    {-1, 161, 162, 163, 164, 165, 166, 167, 168, 169, 170, 171, 172, 173, 174, 175, 176, 416, 417, 418, 419, 420, 421, 422, 423, 424, 425, 426, 427, 428, 429,  -1,  -1, -1},
+    {-1, 145, 146, 147, 148, 149, 150, 151, 152, 153, 154, 155, 156, 157, 158, 159, 160, 400, 401, 402, 403, 404, 405, 406, 407, 408, 409, 410, 411, 412, 413, 414,  -1, -1},
+    {-1, 129, 130, 131, 132, 133, 134, 135, 136, 137, 138, 139, 140, 141, 142, 143, 144, 384, 385, 386, 387, 388, 389, 390, 391, 392, 393, 394, 395, 396, 397, 398,  -1, -1},
+    {-1, 113, 114, 115, 116, 117, 118, 119, 120, 121, 122, 123, 124, 125, 126, 127, 128, 368, 369, 370, 371, 372, 373, 374, 375, 376, 377, 378, 379, 380, 381, 382, 383, -1},
+    {-1,  97,  98,  99, 100, 101, 102, 103, 104, 105, 106, 107, 108, 109, 110, 111, 112, 352, 353, 354, 355, 356, 357, 358, 359, 360, 361, 362, 363, 364, 365, 366, 367, -1},
+    {-1,  81,  82,  83,  84,  85,  86,  87,  88,  89,  90,  91,  92,  93,  94,  95,  96, 336, 337, 338, 339, 340, 341, 342, 343, 344, 345, 346, 347, 348, 349, 350, 351, -1},
+    {-1,  65,  66,  67,  68,  69,  70,  71,  72,  73,  74,  75,  76,  77,  78,  79,  80, 320, 321, 322, 323, 324, 325, 326, 327, 328, 329, 330, 331, 332, 333, 334, 335, -1},
+    {-1,  49,  50,  51,  52,  53,  54,  55,  56,  57,  58,  59,  60,  61,  62,  63,  64, 304, 305, 306, 307, 308, 309, 310, 311, 312, 313, 314, 315, 316, 317, 318,  -1, -1},
+    {-1,  33,  34,  35,  36,  37,  38,  39,  40,  41,  42,  43,  44,  45,  46,  47,  48, 288, 289, 290, 291, 292, 293, 294, 295, 296, 297, 298, 299, 300, 301, 302,  -1, -1},
+    {-1,  17,  18,  19,  20,  21,  22,  23,  24,  25,  26,  27,  28,  29,  30,  31,  32, 272, 273, 274, 275, 276, 277, 278, 279, 280, 281, 282, 283, 284, 285,  -1,  -1, -1},
+    {-1,   1,   2,   3,   4,   5,   6,   7,   8,   9,  10,  11,  12,  13,  14,  15,  16, 256, 257, 258, 259, 260, 261, 262, 263, 264, 265, 266, 267,  -1,  -1,  -1,  -1, -1},
+    {-1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1, -1}
+}};
+
+// And the LED enable registers it wrote by hand
+static constexpr std::array<std::array<uint8_t, driverEnableRegisters>, 2> badgeLedEnable {{
+    {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+     0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
+    {0xFF, 0x0F, 0xFF, 0x3F, 0xFF, 0x7F, 0xFF, 0x7F, 0xFF, 0xFF, 0xFF, 0xFF,
+     0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x7F, 0xFF, 0x7F, 0xFF, 0x3F, 0xFF, 0x0F}
+}};
+
+constexpr bool badgeMatchesBringUp() {
+    constexpr auto tables = makePanelTables<14, 34>(badgeLayout);
+    for (int x = 0; x < 14; x++) {
+        for (int y = 0; y < 34; y++) {
+            const ledSlot& slot = tables.render[x][y];
+            int number = -1;
+            if (slot.driver != noLed) {
+                int reg = tables.upload[slot.driver].firstRegister + slot.offset - 1;
+                number = slot.driver == 0 ? reg + 1 : reg + 256;
+            }
+            if (number != badgeLedNumbers[x][y]) {
+                return false;
+            }
+        }
+    }
+    for (int d = 0; d < 2; d++) {
+        for (int r = 0; r < driverEnableRegisters; r++) {
+            if (tables.upload[d].ledEnable[r] != badgeLedEnable[d][r]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Host builds check every shipped layout
+static_assert(layoutIsValid(badgeLayout), "badge layout has overlapping or out of range runs");
+static_assert(tablesAreConsistent(makePanelTables<14, 34>(badgeLayout)), "badge tables are inconsistent");
+static_assert(badgeMatchesBringUp(), "badge tables differ from the bring-up LED map");
+#endif
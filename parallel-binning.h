@@ -0,0 +1,325 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include "fluid-sim.h"
+
+// Host-only counting sort of particles into cell buckets on several threads. Each thread
+// histograms its own slice of the particles, the bucket starts come out of an exclusive
+// scan over the cells done in blocks, then every thread scatters its slice into the slots
+// the scan reserved for it. The result is the same as the serial sort in rebuildBinning
+// down to the order inside each bucket: that one fills every bucket from its end, so the
+// highest particle index comes first, and here the last slice's slots come first for the
+// same reason. Each phase is one run of a workerPool, its return is the barrier.
+//
+// keyOf(p) is particle p's bucket, place(p, slot, key) is called once for every particle
+// with the slot it lands in. bucketStart gets buckets + 1 entries, the last one the total.
+//
+// A window given a binningPool uses it for full rebuilds from parallelBinningMinParticles
+// up. The badge's 350 particles stay far below that and keep the serial sort.
+
+// Threads that stay up between jobs. run(work) calls work(t) once for every t below
+// threads(), t 0 on the calling thread, and returns once all of them have. One caller at
+// a time.
+class workerPool {
+    public:
+        explicit workerPool(unsigned threads);
+        ~workerPool();
+        workerPool(const workerPool&) = delete;
+        workerPool& operator=(const workerPool&) = delete;
+        unsigned threads() const { return static_cast<unsigned>(workers.size()) + 1; }
+        template <typename Work>
+        void run(Work&& work);
+    private:
+        void serve(unsigned t);
+        std::vector<std::thread> workers;
+        std::mutex lock;
+        std::condition_variable started;
+        std::condition_variable finished;
+        uint64_t generation{0};  // Bumped for every job
+        unsigned running{0};     // Workers still on the current job
+        bool stopping{false};
+        void* job{nullptr};
+        void (*call)(void* job, unsigned t){nullptr};
+};
+
+workerPool::workerPool(unsigned threads){
+    for(unsigned t = 1; t < threads; t++){
+        workers.emplace_back(&workerPool::serve, this, t);
+    }
+}
+
+workerPool::~workerPool(){
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    started.notify_all();
+    for(auto& worker : workers){
+        worker.join();
+    }
+}
+
+template <typename Work>
+void workerPool::run(Work&& work){
+    if(workers.empty()){
+        work(0);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        job = &work;
+        call = [](void* job, unsigned t){ (*static_cast<std::remove_reference_t<Work>*>(job))(t); };
+        running = workers.size();
+        generation++;
+    }
+    started.notify_all();
+    work(0);
+    std::unique_lock<std::mutex> guard(lock);
+    finished.wait(guard, [this]{ return running == 0; });
+}
+
+void workerPool::serve(unsigned t){
+    uint64_t seen = 0;
+    while(true){
+        void* current;
+        void (*currentCall)(void*, unsigned);
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            started.wait(guard, [&]{ return stopping || generation != seen; });
+            if(stopping){
+                return;
+            }
+            seen = generation;
+            current = job;
+            currentCall = call;
+        }
+        currentCall(current, t);
+        bool last;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            last = --running == 0;
+        }
+        if(last){
+            finished.notify_one();
+        }
+    }
+}
+
+template <typename KeyOf, typename Place>
+void countingSortSerial(uint32_t particles, uint32_t buckets, KeyOf keyOf, Place place, uint32_t* bucketStart){
+    std::fill(bucketStart, bucketStart + buckets + 1, 0);
+    for(uint32_t p = 0; p < particles; p++){
+        bucketStart[keyOf(p)]++;
+    }
+    uint32_t sum = 0;
+    for(uint32_t b = 0; b <= buckets; b++){
+        sum += bucketStart[b];
+        bucketStart[b] = sum;
+    }
+    for(uint32_t p = 0; p < particles; p++){
+        uint32_t key = keyOf(p);
+        place(p, --bucketStart[key], key);
+    }
+}
+
+template <typename KeyOf, typename Place>
+void countingSortParallel(uint32_t particles, uint32_t buckets, KeyOf keyOf, Place place, uint32_t* bucketStart,
+                          workerPool& pool){
+    unsigned threads = pool.threads();
+    auto sliceBegin = [&](unsigned t){ return static_cast<uint32_t>(static_cast<uint64_t>(particles) * t / threads); };
+    auto blockBegin = [&](unsigned t){ return static_cast<uint32_t>(static_cast<uint64_t>(buckets) * t / threads); };
+    // The loops take their bounds once, the stores through histogram or place could alias
+    // particles and buckets as far as the compiler knows
+
+    // counts[t][b] becomes where thread t's first particle in bucket b goes
+    std::vector<uint32_t> counts(static_cast<size_t>(threads) * buckets, 0);
+    pool.run([&](unsigned t){
+        uint32_t* histogram = &counts[static_cast<size_t>(t) * buckets];
+        for(uint32_t p = sliceBegin(t), end = sliceBegin(t + 1); p < end; p++){
+            histogram[keyOf(p)]++;
+        }
+    });
+
+    // Bucket totals and their sum per block of buckets, then the blocks' own starts
+    std::vector<uint32_t> blockTotal(threads, 0);
+    pool.run([&](unsigned t){
+        uint32_t sum = 0;
+        for(uint32_t b = blockBegin(t), last = blockBegin(t + 1); b < last; b++){
+            uint32_t total = 0;
+            for(unsigned s = 0; s < threads; s++){
+                total += counts[static_cast<size_t>(s) * buckets + b];
+            }
+            bucketStart[b] = total;
+            sum += total;
+        }
+        blockTotal[t] = sum;
+    });
+    uint32_t sum = 0;
+    for(unsigned t = 0; t < threads; t++){
+        uint32_t total = blockTotal[t];
+        blockTotal[t] = sum;
+        sum += total;
+    }
+    bucketStart[buckets] = sum;
+    pool.run([&](unsigned t){
+        uint32_t start = blockTotal[t];
+        for(uint32_t b = blockBegin(t), last = blockBegin(t + 1); b < last; b++){
+            uint32_t total = bucketStart[b];
+            bucketStart[b] = start;
+            // Later slices first, each filled from the end of its share
+            uint32_t end = start;
+            for(unsigned s = threads; s-- > 0;){
+                uint32_t& count = counts[static_cast<size_t>(s) * buckets + b];
+                end += count;
+                count = end;
+            }
+            start += total;
+        }
+    });
+
+    pool.run([&](unsigned t){
+        uint32_t* next = &counts[static_cast<size_t>(t) * buckets];
+        for(uint32_t p = sliceBegin(t), end = sliceBegin(t + 1); p < end; p++){
+            uint32_t key = keyOf(p);
+            place(p, --next[key], key);
+        }
+    });
+}
+
+void fluidWindow::rebuildBinningOn(workerPool& pool){
+    for(auto& column : cells){
+        for(auto& cell : column){
+            cell.numberParticles = 0;
+            if(cell.isWater()){
+                cell.state = cellStateEnum::air;
+            }
+        }
+    }
+    countingSortParallel(liveParticles, xsize*ysize,
+        [this](uint32_t p){ return particleArray[p].getCellNumber(); },
+        [this](uint32_t p, uint32_t slot, uint32_t cell){
+            particlePointers[slot] = p;
+            particleSlot[p] = slot;
+            binnedCell[p] = cell;
+        },
+        cellParticleCount.data(), pool);
+    for(uint32_t c = 0; c < xsize*ysize; c++){
+        fluidCell& cell = cells[c % xsize][c / xsize];
+        cell.numberParticles = cellParticleCount[c+1] - cellParticleCount[c];
+        if(cell.numberParticles > 0){
+            cell.state = cellStateEnum::water;
+        }
+    }
+    binningValid = true;
+    binning.fullRebuilds++;
+}
+
+// Rebuilds a window's cell index serially and on the pool and checks every bucket start,
+// slot and cell count matches, the order inside each bucket included
+bool matchesRebuildBinning(fluidWindow& window, workerPool& pool){
+    workerPool* attached = window.binningPool;
+    window.binningPool = nullptr;
+    window.rebuildBinning();
+    window.binningPool = attached;
+    auto start = window.cellParticleCount;
+    auto pointers = window.particlePointers;
+    auto slots = window.particleSlot;
+    std::vector<uint32_t> counts;
+    for(auto& column : window.cells){
+        for(auto& cell : column){
+            counts.push_back(cell.numberParticles << 2 | static_cast<uint32_t>(cell.state));
+        }
+    }
+    window.rebuildBinningOn(pool);
+    uint32_t live = window.liveParticles;
+    bool same = start == window.cellParticleCount
+             && std::equal(pointers.begin(), pointers.begin() + live, window.particlePointers.begin())
+             && std::equal(slots.begin(), slots.begin() + live, window.particleSlot.begin());
+    size_t c = 0;
+    for(auto& column : window.cells){
+        for(auto& cell : column){
+            same = same && counts[c++] == (cell.numberParticles << 2 | static_cast<uint32_t>(cell.state));
+        }
+    }
+    return same;
+}
+
+// Sorts random cell numbers for the badge's grid serially and on a pool of 1 to N threads,
+// checks every result matches the serial one and prints how long each took. Then times a
+// window's own rebuild serially and on N threads, and steps it under a swinging tilt with
+// the pool attached for the given frames, checking the pooled rebuild against the serial
+// one slot for slot on every frame.
+//
+//   my_project binning [particles] [threads] [frames]
+int runBinningBenchmark(int argc, char** argv){
+    uint32_t particles = argc > 2 ? atoi(argv[2]) : 1000000;
+    unsigned maxThreads = argc > 3 ? atoi(argv[3]) : std::thread::hardware_concurrency();
+    maxThreads = maxThreads > 0 ? maxThreads : 1;
+    uint32_t frames = argc > 4 ? atoi(argv[4]) : 600;
+    constexpr uint32_t buckets = xsize*ysize;
+    constexpr int repeats = 5;
+
+    std::vector<uint16_t> keys(particles);
+    std::minstd_rand rng(1);
+    for(auto& key : keys){
+        key = rng() % buckets;
+    }
+    auto keyOf = [&](uint32_t p){ return keys[p]; };
+
+    std::vector<uint32_t> serialStart(buckets + 1), serialSorted(particles);
+    auto time = [&](auto sort){
+        double best = 1e30;
+        for(int r = 0; r < repeats; r++){
+            auto start = std::chrono::steady_clock::now();
+            sort();
+            best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+        }
+        return best;
+    };
+    double serialMs = time([&]{
+        countingSortSerial(particles, buckets, keyOf, [&](uint32_t p, uint32_t slot, uint32_t){ serialSorted[slot] = p; },
+                           serialStart.data());
+    });
+
+    printf("particles,threads,serial_ms,parallel_ms,speedup,identical\n");
+    std::vector<uint32_t> start(buckets + 1), sorted(particles);
+    for(unsigned threads = 1; threads <= maxThreads; threads++){
+        workerPool pool(threads);
+        double parallelMs = time([&]{
+            countingSortParallel(particles, buckets, keyOf, [&](uint32_t p, uint32_t slot, uint32_t){ sorted[slot] = p; },
+                                 start.data(), pool);
+        });
+        bool identical = start == serialStart && sorted == serialSorted;
+        printf("%lu,%u,%.3f,%.3f,%.2f,%s\n", (unsigned long)particles, threads, serialMs, parallelMs,
+               serialMs / parallelMs, identical ? "yes" : "NO");
+    }
+
+    workerPool pool(maxThreads);
+    auto window = std::make_unique<fluidWindow>();
+    window->init(1);
+    window->binningPool = &pool;
+    double windowSerialMs = time([&]{ window->binningPool = nullptr; window->rebuildBinning(); window->binningPool = &pool; });
+    double windowPooledMs = time([&]{ window->rebuildBinningOn(pool); });
+    printf("window rebuild of %u particles: serial %.1f us, %u threads %.1f us, stepSim %s the pool from %lu\n",
+           window->liveParticles, windowSerialMs * 1000, maxThreads, windowPooledMs * 1000,
+           window->liveParticles >= parallelBinningMinParticles ? "uses" : "skips", (unsigned long)parallelBinningMinParticles);
+    uint32_t matching = 0;
+    for(uint32_t frame = 0; frame < frames; frame++){
+        window->tiltX = static_cast<int16_t>(3000 * sinf(frame / 20.0f));
+        window->tiltY = static_cast<int16_t>(-4000 * cosf(frame / 37.0f));
+        window->stepSim();
+        matching += matchesRebuildBinning(*window, pool);
+    }
+    printf("window binning on %u threads matches rebuildBinning in %lu of %lu frames\n", maxThreads,
+           (unsigned long)matching, (unsigned long)frames);
+    return matching == frames ? 0 : 1;
+}
@@ -0,0 +1,740 @@
+#pragma once
+#include "fluid-sim.h"
+#if !PICO_ON_DEVICE
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <vector>
+#endif
+
+// Particle-parallel kernels. The device always runs the scalar versions, host builds on
+// x86 and ARM64 pick a SIMD set once at startup. Every version gives bit-identical
+// results to the scalar one. Build with FLUID_SIMD=0 to force the scalar path.
+//
+// Three stages live here: the particle-to-grid stencil, the weights of the toGrid scatter
+// and the PIC/FLIP blend in fromGrid. The stencil offsets go through registers four or
+// eight at a time and a transpose, but particles stay an array of structures shared with
+// the device and the compact layout, so positions, velocities and the cells under each
+// stencil are still gathered a lane at a time. The scatter itself adds the lanes in
+// particle order. Binning or privatising it would change the order the floats are summed
+// in and break the bit-identical guarantee the batch sweeps rely on, and on one core it
+// has no conflict to remove. integrateParticles and checkCollision stay scalar: the wall
+// search in one and the neighbour walk in the other branch per particle and per pair.
+
+#ifndef FLUID_SIMD
+#define FLUID_SIMD 1
+#endif
+
+#if !PICO_ON_DEVICE && FLUID_SIMD && (defined(__x86_64__) || defined(__i386__))
+#define FLUID_SIMD_X86 1
+#include <immintrin.h>
+#elif !PICO_ON_DEVICE && FLUID_SIMD && defined(__aarch64__) && defined(__ARM_NEON)
+#define FLUID_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+using transferKernel = void (*)(fluidParticle* particles, particleTransfer* out, size_t count);
+using scatterKernel = void (*)(cellGrid& cells, fluidParticle* particles, const particleTransfer* transfers, size_t count);
+using blendKernel = void (*)(cellGrid& cells, fluidParticle* particles, const particleTransfer* transfers, size_t count, float ratio);
+
+// The horizontal stencil starts at the particle's own column and the row above or below
+// depending on which half of the cell it is in, the vertical stencil the other way round
+FLUID_HOT(computeTransfersScalar) void computeTransfersScalar(fluidParticle* particles, particleTransfer* out, size_t count){
+    for(size_t p = 0; p < count; p++){
+        fluidParticle& particle = particles[p];
+        particleTransfer& transfer = out[p];
+        float x = particle.getX();
+        float y = particle.getY();
+        int cellX = particle.getCellX();
+        int cellY = particle.getCellY();
+        int horiY = (y - cellY) > 0.5f ? cellY : cellY - 1;
+        int vertX = (x - cellX) > 0.5f ? cellX : cellX - 1;
+        transfer.horiX = cellX;
+        transfer.horiY = horiY;
+        transfer.horiDx = x - cellX;
+        transfer.horiDy = y - (horiY + 0.5f);
+        transfer.vertX = vertX;
+        transfer.vertY = cellY;
+        transfer.vertDx = x - (vertX + 0.5f);
+        transfer.vertDy = y - cellY;
+    }
+}
+
+// The cells under a stencil whose top left is x, y: top left, top right, bottom left and
+// bottom right, clamped at the far edges the way fluidWindow::right and down are
+FLUID_HOT(stencilCorners) void stencilCorners(cellGrid& cells, int x, int y, fluidCell* corners[4]){
+    int x1 = x + 1 < xsize ? x + 1 : x;
+    int y1 = y + 1 < ysize ? y + 1 : y;
+    corners[0] = &cells[x][y];
+    corners[1] = &cells[x1][y];
+    corners[2] = &cells[x][y1];
+    corners[3] = &cells[x1][y1];
+}
+
+// Adds one particle to the grid. weight and flow hold its share of each corner Stride
+// apart, the horizontal stencil's four then the vertical's.
+template <int Stride>
+void scatterParticle(cellGrid& cells, fluidParticle& particle, const particleTransfer& transfer, const float* weight, const float* flow){
+    fluidCell* corners[4];
+    stencilCorners(cells, transfer.horiX, transfer.horiY, corners);
+    for(int c = 0; c < 4; c++){
+        corners[c]->horizontalFlow += flow[c*Stride];
+        corners[c]->horizontalWeight += weight[c*Stride];
+    }
+    stencilCorners(cells, transfer.vertX, transfer.vertY, corners);
+    for(int c = 0; c < 4; c++){
+        corners[c]->verticalFlow += flow[(4 + c)*Stride];
+        corners[c]->verticalWeight += weight[(4 + c)*Stride];
+    }
+    fluidCell& cell = cells[particle.getCellX()][particle.getCellY()];
+    if(cell.isAir()){
+        cell.state = cellStateEnum::water;
+    }
+}
+
+// The one the device calls, the section attribute only holds on an explicit instantiation
+template FLUID_HOT(scatterParticle) void scatterParticle<1>(cellGrid&, fluidParticle&, const particleTransfer&, const float*, const float*);
+
+FLUID_HOT(scatterToGridScalar) void scatterToGridScalar(cellGrid& cells, fluidParticle* particles, const particleTransfer* transfers, size_t count){
+    for(size_t p = 0; p < count; p++){
+        fluidParticle& particle = particles[p];
+        const particleTransfer& transfer = transfers[p];
+        float weight[8], flow[8];
+        float dx[2] = {transfer.horiDx, transfer.vertDx};
+        float dy[2] = {transfer.horiDy, transfer.vertDy};
+        float velocity[2] = {particle.vx, particle.vy};
+        for(int s = 0; s < 2; s++){
+            float sx = 1-dx[s];
+            float sy = 1-dy[s];
+            weight[4*s + 0] = sx*sy;
+            weight[4*s + 1] = dx[s]*sy;
+            weight[4*s + 2] = sx*dy[s];
+            weight[4*s + 3] = dx[s]*dy[s];
+            for(int c = 0; c < 4; c++){
+                flow[4*s + c] = weight[4*s + c]*velocity[s];
+            }
+        }
+        scatterParticle<1>(cells, particle, transfer, weight, flow);
+    }
+}
+
+// PIC takes the grid's flow, FLIP adds the grid's change to the particle's own velocity.
+// Solid corners drop out and the rest are renormalised. Returns false, leaving the
+// velocity alone, when every corner is solid.
+FLUID_HOT(blendStencil) bool blendStencil(fluidCell* corners[4], float (fluidCell::*flowOf), float (fluidCell::*prevFlowOf),
+                                          float dx, float dy, float& velocity, float ratio){
+    float sx = 1-dx;
+    float sy = 1-dy;
+    float weight[4] = {sx*sy, dx*sy, sx*dy, dx*dy};
+    float valid[4];
+    for(int c = 0; c < 4; c++){
+        valid[c] = !corners[c]->isSolid() ? 1 : 0;
+    }
+    float validWeight = valid[0]*weight[0] + valid[1]*weight[1] + valid[2]*weight[2] + valid[3]*weight[3];
+    if(!(validWeight > 0)){
+        return false;
+    }
+    float flow[4], change[4];
+    for(int c = 0; c < 4; c++){
+        flow[c] = corners[c]->*flowOf;
+        change[c] = flow[c] - corners[c]->*prevFlowOf;
+    }
+    float pic = (valid[0]*weight[0]*flow[0] + valid[1]*weight[1]*flow[1] +
+                 valid[2]*weight[2]*flow[2] + valid[3]*weight[3]*flow[3])/validWeight;
+    float corr = (valid[0]*weight[0]*change[0] + valid[1]*weight[1]*change[1] +
+                  valid[2]*weight[2]*change[2] + valid[3]*weight[3]*change[3])/validWeight;
+    float flip = velocity + corr;
+    velocity = flip * ratio + pic * (1.0-ratio);
+    return true;
+}
+
+// Sleeping particles are skipped, fluidWindow::fromGrid has already woken any whose cell
+// picked up flow
+FLUID_HOT(blendFromGridScalar) void blendFromGridScalar(cellGrid& cells, fluidParticle* particles, const particleTransfer* transfers, size_t count, float ratio){
+    for(size_t p = 0; p < count; p++){
+        fluidParticle& particle = particles[p];
+        if(particleSleepBuilt && particle.asleep){
+            continue;
+        }
+        const particleTransfer& transfer = transfers[p];
+        fluidCell* corners[4];
+        float velocity = particle.vx;
+        stencilCorners(cells, transfer.horiX, transfer.horiY, corners);
+        if(blendStencil(corners, &fluidCell::horizontalFlow, &fluidCell::prevHorizontalFlow, transfer.horiDx, transfer.horiDy, velocity, ratio)){
+            particle.vx = velocity;
+        }
+        velocity = particle.vy;
+        stencilCorners(cells, transfer.vertX, transfer.vertY, corners);
+        if(blendStencil(corners, &fluidCell::verticalFlow, &fluidCell::prevVerticalFlow, transfer.vertDx, transfer.vertDy, velocity, ratio)){
+            particle.vy = velocity;
+        }
+    }
+}
+
+#if FLUID_SIMD_X86 || FLUID_SIMD_NEON
+// The corners of one stencil for Lanes particles side by side, for the blend's vector maths
+template <size_t Lanes>
+class stencilLanes {
+    public:
+        alignas(32) float flow[4][Lanes];
+        alignas(32) float prevFlow[4][Lanes];
+        alignas(32) float valid[4][Lanes];
+        alignas(32) float velocity[Lanes];
+        alignas(32) float validWeight[Lanes];
+        alignas(32) float blended[Lanes];
+        template <bool Vertical> void gather(cellGrid& cells, fluidParticle* particles, const particleTransfer* transfers);
+        template <bool Vertical> void store(fluidParticle* particles);
+};
+
+template <size_t Lanes>
+template <bool Vertical>
+void stencilLanes<Lanes>::gather(cellGrid& cells, fluidParticle* particles, const particleTransfer* transfers){
+    for(size_t lane = 0; lane < Lanes; lane++){
+        const particleTransfer& transfer = transfers[lane];
+        fluidCell* corners[4];
+        if constexpr(Vertical){
+            stencilCorners(cells, transfer.vertX, transfer.vertY, corners);
+            velocity[lane] = particles[lane].vy;
+        } else {
+            stencilCorners(cells, transfer.horiX, transfer.horiY, corners);
+            velocity[lane] = particles[lane].vx;
+        }
+        for(int c = 0; c < 4; c++){
+            flow[c][lane] = Vertical ? corners[c]->verticalFlow : corners[c]->horizontalFlow;
+            prevFlow[c][lane] = Vertical ? corners[c]->prevVerticalFlow : corners[c]->prevHorizontalFlow;
+            valid[c][lane] = !corners[c]->isSolid() ? 1 : 0;
+        }
+    }
+}
+
+template <size_t Lanes>
+template <bool Vertical>
+void stencilLanes<Lanes>::store(fluidParticle* particles){
+    for(size_t lane = 0; lane < Lanes; lane++){
+        fluidParticle& particle = particles[lane];
+        if((particleSleepBuilt && particle.asleep) || !(validWeight[lane] > 0)){
+            continue;
+        }
+        if constexpr(Vertical){
+            particle.vy = blended[lane];
+        } else {
+            particle.vx = blended[lane];
+        }
+    }
+}
+#endif
+
+#if FLUID_SIMD_X86
+// The four floats of four transfers as horiDx, horiDy, vertDx and vertDy across lanes, and back
+__attribute__((target("sse4.1"))) void loadOffsetsSse41(const particleTransfer* transfers, __m128 offsets[4]){
+    for(int lane = 0; lane < 4; lane++){
+        offsets[lane] = _mm_loadu_ps(&transfers[lane].horiDx);
+    }
+    _MM_TRANSPOSE4_PS(offsets[0], offsets[1], offsets[2], offsets[3]);
+}
+
+__attribute__((target("sse4.1"))) void storeOffsetsSse41(__m128 offsets[4], particleTransfer* transfers){
+    _MM_TRANSPOSE4_PS(offsets[0], offsets[1], offsets[2], offsets[3]);
+    for(int lane = 0; lane < 4; lane++){
+        _mm_storeu_ps(&transfers[lane].horiDx, offsets[lane]);
+    }
+}
+
+// horiX, horiY, vertX and vertY are the first four bytes of a transfer
+__attribute__((target("sse4.1"))) __m128i packCellsSse41(__m128i horiX, __m128i horiY, __m128i vertX, __m128i vertY){
+    const __m128i byte = _mm_set1_epi32(0xff);
+    __m128i low = _mm_or_si128(_mm_and_si128(horiX, byte), _mm_slli_epi32(_mm_and_si128(horiY, byte), 8));
+    __m128i high = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(vertX, byte), 16), _mm_slli_epi32(vertY, 24));
+    return _mm_or_si128(low, high);
+}
+
+__attribute__((target("sse4.1"))) void computeTransfersSse41(fluidParticle* particles, particleTransfer* out, size_t count){
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 one = _mm_set1_ps(1.0f);
+    alignas(16) uint32_t cells[4];
+    size_t p = 0;
+    for(; p + 4 <= count; p += 4){
+        fluidParticle* pp = particles + p;
+        __m128 x = _mm_setr_ps(pp[0].getX(), pp[1].getX(), pp[2].getX(), pp[3].getX());
+        __m128 y = _mm_setr_ps(pp[0].getY(), pp[1].getY(), pp[2].getY(), pp[3].getY());
+        __m128 cellX = _mm_floor_ps(x);
+        __m128 cellY = _mm_floor_ps(y);
+        __m128 horiY = _mm_blendv_ps(_mm_sub_ps(cellY, one), cellY, _mm_cmpgt_ps(_mm_sub_ps(y, cellY), half));
+        __m128 vertX = _mm_blendv_ps(_mm_sub_ps(cellX, one), cellX, _mm_cmpgt_ps(_mm_sub_ps(x, cellX), half));
+        __m128 offsets[4] = {_mm_sub_ps(x, cellX), _mm_sub_ps(y, _mm_add_ps(horiY, half)),
+                             _mm_sub_ps(x, _mm_add_ps(vertX, half)), _mm_sub_ps(y, cellY)};
+        storeOffsetsSse41(offsets, out + p);
+        _mm_store_si128(reinterpret_cast<__m128i*>(cells), packCellsSse41(_mm_cvttps_epi32(cellX), _mm_cvttps_epi32(horiY),
+                                                                          _mm_cvttps_epi32(vertX), _mm_cvttps_epi32(cellY)));
+        for(int lane = 0; lane < 4; lane++){
+            memcpy(&out[p + lane].horiX, &cells[lane], sizeof(uint32_t));
+        }
+    }
+    computeTransfersScalar(particles + p, out + p, count - p);
+}
+
+// sx*sy, dx*sy, sx*dy and dx*dy, the bilinear weight of each corner
+__attribute__((target("sse4.1"))) void cornerWeightsSse41(__m128 dx, __m128 dy, __m128 weight[4]){
+    const __m128 one = _mm_set1_ps(1.0f);
+    __m128 sx = _mm_sub_ps(one, dx);
+    __m128 sy = _mm_sub_ps(one, dy);
+    weight[0] = _mm_mul_ps(sx, sy);
+    weight[1] = _mm_mul_ps(dx, sy);
+    weight[2] = _mm_mul_ps(sx, dy);
+    weight[3] = _mm_mul_ps(dx, dy);
+}
+
+__attribute__((target("sse4.1"))) void scatterToGridSse41(cellGrid& cells, fluidParticle* particles, const particleTransfer* transfers, size_t count){
+    alignas(16) float weight[8][4], flow[8][4];
+    size_t p = 0;
+    for(; p + 4 <= count; p += 4){
+        fluidParticle* pp = particles + p;
+        __m128 offsets[4];
+        loadOffsetsSse41(transfers + p, offsets);
+        __m128 velocity[2] = {_mm_setr_ps(pp[0].vx, pp[1].vx, pp[2].vx, pp[3].vx),
+                              _mm_setr_ps(pp[0].vy, pp[1].vy, pp[2].vy, pp[3].vy)};
+        for(int s = 0; s < 2; s++){
+            __m128 w[4];
+            cornerWeightsSse41(offsets[2*s], offsets[2*s + 1], w);
+            for(int c = 0; c < 4; c++){
+                _mm_store_ps(weight[4*s + c], w[c]);
+                _mm_store_ps(flow[4*s + c], _mm_mul_ps(w[c], velocity[s]));
+            }
+        }
+        for(int lane = 0; lane < 4; lane++){
+            scatterParticle<4>(cells, pp[lane], transfers[p + lane], &weight[0][lane], &flow[0][lane]);
+        }
+    }
+    scatterToGridScalar(cells, particles + p, transfers + p, count - p);
+}
+
+// The float products are widened before the sum, as the scalar expression's 1.0 does
+__attribute__((target("sse4.1"))) void blendLanesSse41(stencilLanes<4>& lanes, __m128 dx, __m128 dy, float ratio){
+    __m128 weight[4];
+    cornerWeightsSse41(dx, dy, weight);
+    __m128 validWeight = _mm_setzero_ps();
+    __m128 pic = _mm_setzero_ps();
+    __m128 corr = _mm_setzero_ps();
+    for(int c = 0; c < 4; c++){
+        __m128 share = _mm_mul_ps(_mm_load_ps(lanes.valid[c]), weight[c]);
+        __m128 flow = _mm_load_ps(lanes.flow[c]);
+        validWeight = c == 0 ? share : _mm_add_ps(validWeight, share);
+        pic = c == 0 ? _mm_mul_ps(share, flow) : _mm_add_ps(pic, _mm_mul_ps(share, flow));
+        __m128 change = _mm_mul_ps(share, _mm_sub_ps(flow, _mm_load_ps(lanes.prevFlow[c])));
+        corr = c == 0 ? change : _mm_add_ps(corr, change);
+    }
+    pic = _mm_div_ps(pic, validWeight);
+    corr = _mm_div_ps(corr, validWeight);
+    __m128 flip = _mm_mul_ps(_mm_add_ps(_mm_load_ps(lanes.velocity), corr), _mm_set1_ps(ratio));
+    const __m128d keep = _mm_set1_pd(1.0-ratio);
+    __m128d low = _mm_add_pd(_mm_cvtps_pd(flip), _mm_mul_pd(_mm_cvtps_pd(pic), keep));
+    __m128d high = _mm_add_pd(_mm_cvtps_pd(_mm_movehl_ps(flip, flip)), _mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(pic, pic)), keep));
+    _mm_store_ps(lanes.blended, _mm_movelh_ps(_mm_cvtpd_ps(low), _mm_cvtpd_ps(high)));
+    _mm_store_ps(lanes.validWeight, validWeight);
+}
+
+__attribute__((target("sse4.1"))) void blendFromGridSse41(cellGrid& cells, fluidParticle* particles, const particleTransfer* transfers, size_t count, float ratio){
+    stencilLanes<4> lanes;
+    size_t p = 0;
+    for(; p + 4 <= count; p += 4){
+        __m128 offsets[4];
+        loadOffsetsSse41(transfers + p, offsets);
+        lanes.gather<false>(cells, particles + p, transfers + p);
+        blendLanesSse41(lanes, offsets[0], offsets[1], ratio);
+        lanes.store<false>(particles + p);
+        lanes.gather<true>(cells, particles + p, transfers + p);
+        blendLanesSse41(lanes, offsets[2], offsets[3], ratio);
+        lanes.store<true>(particles + p);
+    }
+    blendFromGridScalar(cells, particles + p, transfers + p, count - p, ratio);
+}
+
+// Eight transfers as two groups of four, one per 128-bit half
+__attribute__((target("avx2"))) void transposeOffsetsAvx2(__m256 rows[4]){
+    __m256 t0 = _mm256_unpacklo_ps(rows[0], rows[1]);
+    __m256 t1 = _mm256_unpackhi_ps(rows[0], rows[1]);
+    __m256 t2 = _mm256_unpacklo_ps(rows[2], rows[3]);
+    __m256 t3 = _mm256_unpackhi_ps(rows[2], rows[3]);
+    rows[0] = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    rows[1] = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    rows[2] = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    rows[3] = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+}
+
+__attribute__((target("avx2"))) void loadOffsetsAvx2(const particleTransfer* transfers, __m256 offsets[4]){
+    for(int lane = 0; lane < 4; lane++){
+        offsets[lane] = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(&transfers[lane].horiDx)),
+                                             _mm_loadu_ps(&transfers[lane + 4].horiDx), 1);
+    }
+    transposeOffsetsAvx2(offsets);
+}
+
+__attribute__((target("avx2"))) void storeOffsetsAvx2(__m256 offsets[4], particleTransfer* transfers){
+    transposeOffsetsAvx2(offsets);
+    for(int lane = 0; lane < 4; lane++){
+        _mm_storeu_ps(&transfers[lane].horiDx, _mm256_castps256_ps128(offsets[lane]));
+        _mm_storeu_ps(&transfers[lane + 4].horiDx, _mm256_extractf128_ps(offsets[lane], 1));
+    }
+}
+
+__attribute__((target("avx2"))) __m256i packCellsAvx2(__m256i horiX, __m256i horiY, __m256i vertX, __m256i vertY){
+    const __m256i byte = _mm256_set1_epi32(0xff);
+    __m256i low = _mm256_or_si256(_mm256_and_si256(horiX, byte), _mm256_slli_epi32(_mm256_and_si256(horiY, byte), 8));
+    __m256i high = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(vertX, byte), 16), _mm256_slli_epi32(vertY, 24));
+    return _mm256_or_si256(low, high);
+}
+
+__attribute__((target("avx2"))) void computeTransfersAvx2(fluidParticle* particles, particleTransfer* out, size_t count){
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    alignas(32) uint32_t cells[8];
+    size_t p = 0;
+    for(; p + 8 <= count; p += 8){
+        fluidParticle* pp = particles + p;
+        __m256 x = _mm256_setr_ps(pp[0].getX(), pp[1].getX(), pp[2].getX(), pp[3].getX(),
+                                  pp[4].getX(), pp[5].getX(), pp[6].getX(), pp[7].getX());
+        __m256 y = _mm256_setr_ps(pp[0].getY(), pp[1].getY(), pp[2].getY(), pp[3].getY(),
+                                  pp[4].getY(), pp[5].getY(), pp[6].getY(), pp[7].getY());
+        __m256 cellX = _mm256_floor_ps(x);
+        __m256 cellY = _mm256_floor_ps(y);
+        __m256 horiY = _mm256_blendv_ps(_mm256_sub_ps(cellY, one), cellY, _mm256_cmp_ps(_mm256_sub_ps(y, cellY), half, _CMP_GT_OQ));
+        __m256 vertX = _mm256_blendv_ps(_mm256_sub_ps(cellX, one), cellX, _mm256_cmp_ps(_mm256_sub_ps(x, cellX), half, _CMP_GT_OQ));
+        __m256 offsets[4] = {_mm256_sub_ps(x, cellX), _mm256_sub_ps(y, _mm256_add_ps(horiY, half)),
+                             _mm256_sub_ps(x, _mm256_add_ps(vertX, half)), _mm256_sub_ps(y, cellY)};
+        storeOffsetsAvx2(offsets, out + p);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(cells), packCellsAvx2(_mm256_cvttps_epi32(cellX), _mm256_cvttps_epi32(horiY),
+                                                                            _mm256_cvttps_epi32(vertX), _mm256_cvttps_epi32(cellY)));
+        for(int lane = 0; lane < 8; lane++){
+            memcpy(&out[p + lane].horiX, &cells[lane], sizeof(uint32_t));
+        }
+    }
+    computeTransfersScalar(particles + p, out + p, count - p);
+}
+
+__attribute__((target("avx2"))) void cornerWeightsAvx2(__m256 dx, __m256 dy, __m256 weight[4]){
+    const __m256 one = _mm256_set1_ps(1.0f);
+    __m256 sx = _mm256_sub_ps(one, dx);
+    __m256 sy = _mm256_sub_ps(one, dy);
+    weight[0] = _mm256_mul_ps(sx, sy);
+    weight[1] = _mm256_mul_ps(dx, sy);
+    weight[2] = _mm256_mul_ps(sx, dy);
+    weight[3] = _mm256_mul_ps(dx, dy);
+}
+
+__attribute__((target("avx2"))) void scatterToGridAvx2(cellGrid& cells, fluidParticle* particles, const particleTransfer* transfers, size_t count){
+    alignas(32) float weight[8][8], flow[8][8];
+    size_t p = 0;
+    for(; p + 8 <= count; p += 8){
+        fluidParticle* pp = particles + p;
+        __m256 offsets[4];
+        loadOffsetsAvx2(transfers + p, offsets);
+        __m256 velocity[2] = {_mm256_setr_ps(pp[0].vx, pp[1].vx, pp[2].vx, pp[3].vx, pp[4].vx, pp[5].vx, pp[6].vx, pp[7].vx),
+                              _mm256_setr_ps(pp[0].vy, pp[1].vy, pp[2].vy, pp[3].vy, pp[4].vy, pp[5].vy, pp[6].vy, pp[7].vy)};
+        for(int s = 0; s < 2; s++){
+            __m256 w[4];
+            cornerWeightsAvx2(offsets[2*s], offsets[2*s + 1], w);
+            for(int c = 0; c < 4; c++){
+                _mm256_store_ps(weight[4*s + c], w[c]);
+                _mm256_store_ps(flow[4*s + c], _mm256_mul_ps(w[c], velocity[s]));
+            }
+        }
+        for(int lane = 0; lane < 8; lane++){
+            scatterParticle<8>(cells, pp[lane], transfers[p + lane], &weight[0][lane], &flow[0][lane]);
+        }
+    }
+    scatterToGridScalar(cells, particles + p, transfers + p, count - p);
+}
+
+__attribute__((target("avx2"))) void blendLanesAvx2(stencilLanes<8>& lanes, __m256 dx, __m256 dy, float ratio){
+    __m256 weight[4];
+    cornerWeightsAvx2(dx, dy, weight);
+    __m256 validWeight = _mm256_setzero_ps();
+    __m256 pic = _mm256_setzero_ps();
+    __m256 corr = _mm256_setzero_ps();
+    for(int c = 0; c < 4; c++){
+        __m256 share = _mm256_mul_ps(_mm256_load_ps(lanes.valid[c]), weight[c]);
+        __m256 flow = _mm256_load_ps(lanes.flow[c]);
+        validWeight = c == 0 ? share : _mm256_add_ps(validWeight, share);
+        pic = c == 0 ? _mm256_mul_ps(share, flow) : _mm256_add_ps(pic, _mm256_mul_ps(share, flow));
+        __m256 change = _mm256_mul_ps(share, _mm256_sub_ps(flow, _mm256_load_ps(lanes.prevFlow[c])));
+        corr = c == 0 ? change : _mm256_add_ps(corr, change);
+    }
+    pic = _mm256_div_ps(pic, validWeight);
+    corr = _mm256_div_ps(corr, validWeight);
+    __m256 flip = _mm256_mul_ps(_mm256_add_ps(_mm256_load_ps(lanes.velocity), corr), _mm256_set1_ps(ratio));
+    const __m256d keep = _mm256_set1_pd(1.0-ratio);
+    __m256d low = _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(flip)), _mm256_mul_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(pic)), keep));
+    __m256d high = _mm256_add_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(flip, 1)), _mm256_mul_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(pic, 1)), keep));
+    _mm256_store_ps(lanes.blended, _mm256_insertf128_ps(_mm256_castps128_ps256(_mm256_cvtpd_ps(low)), _mm256_cvtpd_ps(high), 1));
+    _mm256_store_ps(lanes.validWeight, validWeight);
+}
+
+__attribute__((target("avx2"))) void blendFromGridAvx2(cellGrid& cells, fluidParticle* particles, const particleTransfer* transfers, size_t count, float ratio){
+    stencilLanes<8> lanes;
+    size_t p = 0;
+    for(; p + 8 <= count; p += 8){
+        __m256 offsets[4];
+        loadOffsetsAvx2(transfers + p, offsets);
+        lanes.gather<false>(cells, particles + p, transfers + p);
+        blendLanesAvx2(lanes, offsets[0], offsets[1], ratio);
+        lanes.store<false>(particles + p);
+        lanes.gather<true>(cells, particles + p, transfers + p);
+        blendLanesAvx2(lanes, offsets[2], offsets[3], ratio);
+        lanes.store<true>(particles + p);
+    }
+    blendFromGridScalar(cells, particles + p, transfers + p, count - p, ratio);
+}
+#endif
+
+#if FLUID_SIMD_NEON
+void transposeOffsetsNeon(float32x4_t rows[4]){
+    float32x4x2_t t01 = vtrnq_f32(rows[0], rows[1]);
+    float32x4x2_t t23 = vtrnq_f32(rows[2], rows[3]);
+    rows[0] = vcombine_f32(vget_low_f32(t01.val[0]), vget_low_f32(t23.val[0]));
+    rows[1] = vcombine_f32(vget_low_f32(t01.val[1]), vget_low_f32(t23.val[1]));
+    rows[2] = vcombine_f32(vget_high_f32(t01.val[0]), vget_high_f32(t23.val[0]));
+    rows[3] = vcombine_f32(vget_high_f32(t01.val[1]), vget_high_f32(t23.val[1]));
+}
+
+void loadOffsetsNeon(const particleTransfer* transfers, float32x4_t offsets[4]){
+    for(int lane = 0; lane < 4; lane++){
+        offsets[lane] = vld1q_f32(&transfers[lane].horiDx);
+    }
+    transposeOffsetsNeon(offsets);
+}
+
+void storeOffsetsNeon(float32x4_t offsets[4], particleTransfer* transfers){
+    transposeOffsetsNeon(offsets);
+    for(int lane = 0; lane < 4; lane++){
+        vst1q_f32(&transfers[lane].horiDx, offsets[lane]);
+    }
+}
+
+uint32x4_t packCellsNeon(int32x4_t horiX, int32x4_t horiY, int32x4_t vertX, int32x4_t vertY){
+    const uint32x4_t byte = vdupq_n_u32(0xff);
+    uint32x4_t low = vorrq_u32(vandq_u32(vreinterpretq_u32_s32(horiX), byte), vshlq_n_u32(vandq_u32(vreinterpretq_u32_s32(horiY), byte), 8));
+    uint32x4_t high = vorrq_u32(vshlq_n_u32(vandq_u32(vreinterpretq_u32_s32(vertX), byte), 16), vshlq_n_u32(vreinterpretq_u32_s32(vertY), 24));
+    return vorrq_u32(low, high);
+}
+
+void computeTransfersNeon(fluidParticle* particles, particleTransfer* out, size_t count){
+    const float32x4_t half = vdupq_n_f32(0.5f);
+    const float32x4_t one = vdupq_n_f32(1.0f);
+    uint32_t cells[4];
+    size_t p = 0;
+    for(; p + 4 <= count; p += 4){
+        fluidParticle* pp = particles + p;
+        float xs[4] = {pp[0].getX(), pp[1].getX(), pp[2].getX(), pp[3].getX()};
+        float ys[4] = {pp[0].getY(), pp[1].getY(), pp[2].getY(), pp[3].getY()};
+        float32x4_t x = vld1q_f32(xs);
+        float32x4_t y = vld1q_f32(ys);
+        float32x4_t cellX = vrndmq_f32(x);
+        float32x4_t cellY = vrndmq_f32(y);
+        float32x4_t horiY = vbslq_f32(vcgtq_f32(vsubq_f32(y, cellY), half), cellY, vsubq_f32(cellY, one));
+        float32x4_t vertX = vbslq_f32(vcgtq_f32(vsubq_f32(x, cellX), half), cellX, vsubq_f32(cellX, one));
+        float32x4_t offsets[4] = {vsubq_f32(x, cellX), vsubq_f32(y, vaddq_f32(horiY, half)),
+                                  vsubq_f32(x, vaddq_f32(vertX, half)), vsubq_f32(y, cellY)};
+        storeOffsetsNeon(offsets, out + p);
+        vst1q_u32(cells, packCellsNeon(vcvtq_s32_f32(cellX), vcvtq_s32_f32(horiY), vcvtq_s32_f32(vertX), vcvtq_s32_f32(cellY)));
+        for(int lane = 0; lane < 4; lane++){
+            memcpy(&out[p + lane].horiX, &cells[lane], sizeof(uint32_t));
+        }
+    }
+    computeTransfersScalar(particles + p, out + p, count - p);
+}
+
+void cornerWeightsNeon(float32x4_t dx, float32x4_t dy, float32x4_t weight[4]){
+    const float32x4_t one = vdupq_n_f32(1.0f);
+    float32x4_t sx = vsubq_f32(one, dx);
+    float32x4_t sy = vsubq_f32(one, dy);
+    weight[0] = vmulq_f32(sx, sy);
+    weight[1] = vmulq_f32(dx, sy);
+    weight[2] = vmulq_f32(sx, dy);
+    weight[3] = vmulq_f32(dx, dy);
+}
+
+void scatterToGridNeon(cellGrid& cells, fluidParticle* particles, const particleTransfer* transfers, size_t count){
+    float weight[8][4], flow[8][4];
+    size_t p = 0;
+    for(; p + 4 <= count; p += 4){
+        fluidParticle* pp = particles + p;
+        float32x4_t offsets[4];
+        loadOffsetsNeon(transfers + p, offsets);
+        float vxs[4] = {pp[0].vx, pp[1].vx, pp[2].vx, pp[3].vx};
+        float vys[4] = {pp[0].vy, pp[1].vy, pp[2].vy, pp[3].vy};
+        float32x4_t velocity[2] = {vld1q_f32(vxs), vld1q_f32(vys)};
+        for(int s = 0; s < 2; s++){
+            float32x4_t w[4];
+            cornerWeightsNeon(offsets[2*s], offsets[2*s + 1], w);
+            for(int c = 0; c < 4; c++){
+                vst1q_f32(weight[4*s + c], w[c]);
+                vst1q_f32(flow[4*s + c], vmulq_f32(w[c], velocity[s]));
+            }
+        }
+        for(int lane = 0; lane < 4; lane++){
+            scatterParticle<4>(cells, pp[lane], transfers[p + lane], &weight[0][lane], &flow[0][lane]);
+        }
+    }
+    scatterToGridScalar(cells, particles + p, transfers + p, count - p);
+}
+
+void blendLanesNeon(stencilLanes<4>& lanes, float32x4_t dx, float32x4_t dy, float ratio){
+    float32x4_t weight[4];
+    cornerWeightsNeon(dx, dy, weight);
+    float32x4_t validWeight = vdupq_n_f32(0);
+    float32x4_t pic = vdupq_n_f32(0);
+    float32x4_t corr = vdupq_n_f32(0);
+    for(int c = 0; c < 4; c++){
+        float32x4_t share = vmulq_f32(vld1q_f32(lanes.valid[c]), weight[c]);
+        float32x4_t flow = vld1q_f32(lanes.flow[c]);
+        validWeight = c == 0 ? share : vaddq_f32(validWeight, share);
+        pic = c == 0 ? vmulq_f32(share, flow) : vaddq_f32(pic, vmulq_f32(share, flow));
+        float32x4_t change = vmulq_f32(share, vsubq_f32(flow, vld1q_f32(lanes.prevFlow[c])));
+        corr = c == 0 ? change : vaddq_f32(corr, change);
+    }
+    pic = vdivq_f32(pic, validWeight);
+    corr = vdivq_f32(corr, validWeight);
+    float32x4_t flip = vmulq_f32(vaddq_f32(vld1q_f32(lanes.velocity), corr), vdupq_n_f32(ratio));
+    const float64x2_t keep = vdupq_n_f64(1.0-ratio);
+    float64x2_t low = vaddq_f64(vcvt_f64_f32(vget_low_f32(flip)), vmulq_f64(vcvt_f64_f32(vget_low_f32(pic)), keep));
+    float64x2_t high = vaddq_f64(vcvt_high_f64_f32(flip), vmulq_f64(vcvt_high_f64_f32(pic), keep));
+    vst1q_f32(lanes.blended, vcvt_high_f32_f64(vcvt_f32_f64(low), high));
+    vst1q_f32(lanes.validWeight, validWeight);
+}
+
+void blendFromGridNeon(cellGrid& cells, fluidParticle* particles, const particleTransfer* transfers, size_t count, float ratio){
+    stencilLanes<4> lanes;
+    size_t p = 0;
+    for(; p + 4 <= count; p += 4){
+        float32x4_t offsets[4];
+        loadOffsetsNeon(transfers + p, offsets);
+        lanes.gather<false>(cells, particles + p, transfers + p);
+        blendLanesNeon(lanes, offsets[0], offsets[1], ratio);
+        lanes.store<false>(particles + p);
+        lanes.gather<true>(cells, particles + p, transfers + p);
+        blendLanesNeon(lanes, offsets[2], offsets[3], ratio);
+        lanes.store<true>(particles + p);
+    }
+    blendFromGridScalar(cells, particles + p, transfers + p, count - p, ratio);
+}
+#endif
+
+// One version of every particle-parallel stage, all from the same instruction set
+class particleKernelSet {
+    public:
+        const char* name;
+        transferKernel computeTransfers;
+        scatterKernel scatterToGrid;
+        blendKernel blendFromGrid;
+};
+
+static constexpr particleKernelSet scalarKernels{"scalar", computeTransfersScalar, scatterToGridScalar, blendFromGridScalar};
+
+particleKernelSet selectParticleKernels(){
+#if FLUID_SIMD_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")){
+        return {"avx2", computeTransfersAvx2, scatterToGridAvx2, blendFromGridAvx2};
+    }
+    if(__builtin_cpu_supports("sse4.1")){
+        return {"sse4.1", computeTransfersSse41, scatterToGridSse41, blendFromGridSse41};
+    }
+#elif FLUID_SIMD_NEON
+    return {"neon", computeTransfersNeon, scatterToGridNeon, blendFromGridNeon};
+#endif
+    return scalarKernels;
+}
+
+#if PICO_ON_DEVICE
+static constexpr particleKernelSet particleKernels = scalarKernels;
+#else
+static const particleKernelSet particleKernels = selectParticleKernels();
+#endif
+
+#if !PICO_ON_DEVICE
+// Times each scalar stage against the one picked at startup on synthetic particles spread
+// over a walled grid with random flow, and checks both leave the same bytes behind. The
+// scatter is timed into a cleared grid each run, the blend from a fresh copy of the
+// particles. Without a count it runs 10k, 100k and 1M particles.
+//
+//   my_project kernels [particles]
+int runKernelBenchmark(int argc, char** argv){
+    std::vector<size_t> counts{10000, 100000, 1000000};
+    if(argc > 2){
+        counts = {static_cast<size_t>(atoi(argv[2]))};
+    }
+    constexpr int repeats = 5;
+    constexpr float ratio = 0.9f;
+    std::minstd_rand rng(1);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f), speed(-20.0f, 20.0f);
+    auto flowGrid = std::make_unique<cellGrid>();
+    for(int i = 0; i < xsize; i++){
+        for(int j = 0; j < ysize; j++){
+            fluidCell& cell = (*flowGrid)[i][j];
+            cell.x = i;
+            cell.y = j;
+            bool wall = i == 0 || j == 0 || i == xsize - 1 || j == ysize - 1;
+            cell.state = wall ? cellStateEnum::solid : cellStateEnum::water;
+            cell.horizontalFlow = speed(rng);
+            cell.verticalFlow = speed(rng);
+            cell.prevHorizontalFlow = speed(rng);
+            cell.prevVerticalFlow = speed(rng);
+        }
+    }
+    auto emptyGrid = std::make_unique<cellGrid>();
+    for(int i = 0; i < xsize; i++){
+        for(int j = 0; j < ysize; j++){
+            (*emptyGrid)[i][j] = (*flowGrid)[i][j];
+            (*emptyGrid)[i][j].state = (*flowGrid)[i][j].isSolid() ? cellStateEnum::solid : cellStateEnum::air;
+            (*emptyGrid)[i][j].horizontalFlow = (*emptyGrid)[i][j].verticalFlow = 0;
+        }
+    }
+    printf("stage,particles,kernel,scalar_ns,kernel_ns,speedup,identical\n");
+    for(size_t count : counts){
+        std::vector<fluidParticle> particles(count);
+        for(auto& particle : particles){
+            particle.setCoordinates(1.0f + unit(rng)*(xsize - 2.0f), 1.0f + unit(rng)*(ysize - 2.0f));
+            particle.vx = speed(rng);
+            particle.vy = speed(rng);
+        }
+        std::vector<particleTransfer> transfers(count), kernelTransfers(count);
+        computeTransfersScalar(particles.data(), transfers.data(), count);
+        std::vector<fluidParticle> blended(count);
+        auto scatterGrid = std::make_unique<cellGrid>();
+        // Best of the repeats per particle, reset() runs untimed before each
+        auto time = [&](auto reset, auto run){
+            double best = 1e30;
+            for(int r = 0; r < repeats; r++){
+                reset();
+                auto start = std::chrono::steady_clock::now();
+                run();
+                best = std::min(best, std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count());
+            }
+            return best / (count > 0 ? count : 1);
+        };
+        auto report = [&](const char* stage, double scalarNs, double kernelNs, bool identical){
+            printf("%s,%lu,%s,%.3f,%.3f,%.2f,%s\n", stage, (unsigned long)count, particleKernels.name, scalarNs, kernelNs,
+                   scalarNs / kernelNs, identical ? "yes" : "NO");
+        };
+
+        auto noReset = []{};
+        double scalarNs = time(noReset, [&]{ computeTransfersScalar(particles.data(), transfers.data(), count); });
+        double kernelNs = time(noReset, [&]{ particleKernels.computeTransfers(particles.data(), kernelTransfers.data(), count); });
+        report("stencil", scalarNs, kernelNs, memcmp(transfers.data(), kernelTransfers.data(), count * sizeof(particleTransfer)) == 0);
+
+        auto clearGrid = [&]{ *scatterGrid = *emptyGrid; };
+        scalarNs = time(clearGrid, [&]{ scatterToGridScalar(*scatterGrid, particles.data(), transfers.data(), count); });
+        auto scalarGrid = std::make_unique<cellGrid>(*scatterGrid);
+        kernelNs = time(clearGrid, [&]{ particleKernels.scatterToGrid(*scatterGrid, particles.data(), transfers.data(), count); });
+        report("scatter", scalarNs, kernelNs, memcmp(scalarGrid.get(), scatterGrid.get(), sizeof(cellGrid)) == 0);
+
+        auto copyParticles = [&]{ blended = particles; };
+        scalarNs = time(copyParticles, [&]{ blendFromGridScalar(*flowGrid, blended.data(), transfers.data(), count, ratio); });
+        std::vector<fluidParticle> scalarBlended = blended;
+        kernelNs = time(copyParticles, [&]{ particleKernels.blendFromGrid(*flowGrid, blended.data(), transfers.data(), count, ratio); });
+        report("blend", scalarNs, kernelNs, memcmp(scalarBlended.data(), blended.data(), count * sizeof(fluidParticle)) == 0);
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,95 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <vector>
+#include "fluid-sim.h"
+#include "batch-runner.h"
+
+// Host-only checks for the particle pool, emit and absorb against the cell index, and how
+// the frame time scales with the live count.
+
+// Everything in the cell index agrees with itself and with binnedCell, and every
+// particleId is either live or on the free list exactly once
+bool binningConsistent(fluidWindow& window){
+    if(window.cellParticleCount[spareBucket] != window.liveParticles){
+        return false;
+    }
+    for(uint32_t c = 0; c < spareBucket; c++){
+        const fluidCell& cell = window.cells[c % xsize][c / xsize];
+        uint32_t first = window.cellParticleCount[c];
+        uint32_t last = window.cellParticleCount[c+1];
+        if(last < first || cell.numberParticles != last - first || (last > first && cell.state != cellStateEnum::water)){
+            return false;
+        }
+        for(uint32_t slot = first; slot < last; slot++){
+            uint32_t p = window.particlePointers[slot];
+            if(p >= window.liveParticles || window.particleSlot[p] != slot || window.binnedCell[p] != c){
+                return false;
+            }
+        }
+    }
+    std::vector<uint8_t> seen(numParticles, 0);
+    for(auto& particle : window.live()){
+        seen[particle.particleId]++;
+    }
+    for(uint32_t f = 0; f < window.freeIdCount; f++){
+        seen[window.freeIds[f]]++;
+    }
+    return std::all_of(seen.begin(), seen.end(), [](uint8_t count){ return count == 1; });
+}
+
+// How the frame time follows the number of live particles, then a run that absorbs and
+// emits churn particles every frame and checks the cell index after each change
+//
+//   my_project pool [frames] [churn]
+int runPoolBenchmark(int argc, char** argv){
+    uint32_t frames = argc > 2 ? atoi(argv[2]) : 600;
+    uint32_t churn = argc > 3 ? atoi(argv[3]) : 8;
+    std::vector<inputSample> trace = makeSwingTrace(frames, 1);
+    auto window = std::make_unique<fluidWindow>();
+    window->params.adaptiveQuality = false;
+
+    printf("live,mean_frame_us\n");
+    for(uint32_t quarters = 4; quarters > 0; quarters--){
+        window->init(1, numParticles * quarters / 4);
+        auto start = std::chrono::steady_clock::now();
+        for(const auto& sample : trace){
+            window->tiltX = sample.tiltX;
+            window->tiltY = sample.tiltY;
+            window->stepSim();
+        }
+        double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        printf("%u,%.1f\n", window->liveParticles, us / frames);
+    }
+
+    window->init(1, numParticles * 3 / 4);
+    std::minstd_rand rng(2);
+    uint32_t emitted = 0, absorbed = 0, inconsistent = 0;
+    for(const auto& sample : trace){
+        for(uint32_t k = 0; k < churn && window->liveParticles > 0; k++){
+            window->absorb(rng() % window->liveParticles);
+            absorbed++;
+            inconsistent += window->binningValid && !binningConsistent(*window);
+        }
+        for(uint32_t k = 0; k < churn; k++){
+            // Some of the bounding box is outside the panel
+            bool placed = false;
+            for(int tries = 0; tries < 16 && !placed; tries++){
+                float x = std::uniform_real_distribution<float>(1, xsize - 1)(rng);
+                float y = std::uniform_real_distribution<float>(1, ysize - 1)(rng);
+                placed = window->emit(x, y, 0, 0);
+            }
+            emitted += placed;
+            inconsistent += window->binningValid && !binningConsistent(*window);
+        }
+        window->tiltX = sample.tiltX;
+        window->tiltY = sample.tiltY;
+        window->stepSim();
+    }
+    printf("churn %u per frame: %u absorbed, %u emitted, %u live, %u inconsistent index states\n",
+           churn, absorbed, emitted, window->liveParticles, inconsistent);
+    return inconsistent == 0 ? 0 : 1;
+}
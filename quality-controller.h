@@ -0,0 +1,105 @@
+#pragma once
+#include <array>
+#include "pico/stdlib.h"
+
+// Picks the solver quality for each frame so stepSim stays inside its time budget.
+// Quality drops as soon as a frame goes over budget and only climbs back after the
+// next level has been predicted to fit, with margin, for a full second of frames.
+
+enum class simStage {
+    integrate,
+    collisions,
+    toGrid,
+    pressure,
+    fromGrid,
+    render,
+    count
+};
+
+static constexpr int simStageCount = static_cast<int>(simStage::count);
+
+class simQuality {
+    public:
+        uint8_t pressureIterations;
+        uint8_t collisionIterations;
+};
+
+// Lowest to highest, the last level is the original fixed configuration
+static constexpr std::array<simQuality, 4> qualityLevels {{
+    {10, 1},
+    {20, 2},
+    {30, 3},
+    {40, 5}
+}};
+
+static constexpr uint8_t maxQualityLevel = qualityLevels.size() - 1;
+static constexpr uint32_t defaultFrameBudgetUs{14000};  // Of the 16.7 ms frame
+static constexpr float qualityUpMargin{0.85f};          // Predicted cost must fit in 85% of the budget
+static constexpr uint8_t qualityUpFrames{60};           // for this many frames in a row
+
+class qualityController {
+    public:
+        uint32_t budgetUs{defaultFrameBudgetUs};
+        uint8_t level{maxQualityLevel};
+        uint32_t frameUs{0};
+        std::array<uint32_t, simStageCount> stageUs{};
+        std::array<uint32_t, qualityLevels.size()> framesAtLevel{};
+        const simQuality& current();
+        void startStage();
+        void endStage(simStage stage);
+        void endFrame();
+    private:
+        uint32_t stageStartUs{0};
+        uint8_t fitFrames{0};
+        uint32_t predictCost(uint8_t newLevel);
+};
+
+const simQuality& qualityController::current(){
+    return qualityLevels[level];
+}
+
+void qualityController::startStage(){
+    stageStartUs = time_us_32();
+}
+
+void qualityController::endStage(simStage stage){
+    uint32_t now = time_us_32();
+    stageUs[static_cast<int>(stage)] = now - stageStartUs;
+    stageStartUs = now;
+}
+
+// Scales the iteration-bound stages by their measured per-iteration cost
+uint32_t qualityController::predictCost(uint8_t newLevel){
+    const simQuality& from = qualityLevels[level];
+    const simQuality& to = qualityLevels[newLevel];
+    uint32_t pressureUs = stageUs[static_cast<int>(simStage::pressure)];
+    uint32_t collisionUs = stageUs[static_cast<int>(simStage::collisions)];
+    return frameUs - pressureUs - collisionUs
+         + pressureUs * to.pressureIterations / from.pressureIterations
+         + collisionUs * to.collisionIterations / from.collisionIterations;
+}
+
+void qualityController::endFrame(){
+    frameUs = 0;
+    for(auto us : stageUs){
+        frameUs += us;
+    }
+    framesAtLevel[level]++;
+
+    if(frameUs > budgetUs){
+        // Drop at least one level, further if that is still predicted to overrun
+        uint8_t newLevel = level > 0 ? level - 1 : 0;
+        while(newLevel > 0 && predictCost(newLevel) > budgetUs){
+            newLevel--;
+        }
+        level = newLevel;
+        fitFrames = 0;
+    } else if(level < maxQualityLevel && predictCost(level+1) < budgetUs * qualityUpMargin){
+        if(++fitFrames >= qualityUpFrames){
+            fitFrames = 0;
+            level++;
+        }
+    } else {
+        fitFrames = 0;
+    }
+}
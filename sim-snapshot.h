@@ -0,0 +1,244 @@
+#pragma once
+#include <atomic>
+#include <cstring>
+#include <type_traits>
+#include "fluid-sim.h"
+#if PICO_ON_DEVICE
+#include "hardware/flash.h"
+#include "pico/flash.h"
+#endif
+
+// Compact copy of the fluid so the badge can come back up already settled instead of
+// scattering the particles and waiting for them to fall. Positions and velocities are
+// quantized to 16 bits. The grid isn't stored, toGrid rebuilds it from the particles
+// at the start of every frame.
+//
+// The device keeps one snapshot in the last flash sector, host builds read and write
+// the same bytes to a file.
+
+static constexpr uint32_t snapshotMagic{0x504E5346};  // "FSNP"
+static constexpr uint16_t snapshotVersion{2};
+static constexpr float snapshotPositionScale{1024.0f};  // LSBs per cell
+static constexpr float snapshotVelocityScale{64.0f};    // LSBs per cell per second
+
+static_assert(xsize * snapshotPositionScale <= 65536 && ysize * snapshotPositionScale <= 65536,
+              "snapshot positions must fit in 16 bits");
+
+class snapshotParticle {
+    public:
+        uint16_t x{0};
+        uint16_t y{0};
+        int16_t vx{0};
+        int16_t vy{0};
+};
+
+class simSnapshot {
+    public:
+        uint32_t magic{0};
+        uint32_t checksum{0};  // Over everything after this field
+        uint16_t version{0};
+        uint16_t particles{0};  // Live ones, out of the pool of numParticles
+        uint8_t width{0};
+        uint8_t height{0};
+        uint8_t state{0};
+        uint8_t reserved{0};
+        int16_t wakeTiltX{0};  // Tilt the sleeping particles came to rest under
+        int16_t wakeTiltY{0};
+        uint32_t loopNumber{0};
+        std::array<uint8_t, (numParticles + 31) / 32 * 4> asleep{};  // One bit per particle, whole words
+        std::array<uint8_t, (numParticles + 31) / 32 * 4> live{};
+        std::array<snapshotParticle, numParticles> particle{};  // By particleId, only the live ones used
+        uint32_t computeChecksum() const;
+        bool isValid() const;
+};
+
+// Stored as raw bytes, so no padding may sneak in between the fields
+static_assert(std::has_unique_object_representations_v<simSnapshot>, "simSnapshot has padding");
+
+// FNV-1a
+uint32_t simSnapshot::computeChecksum() const{
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(this);
+    uint32_t hash = 2166136261u;
+    for(size_t i = offsetof(simSnapshot, version); i < sizeof(simSnapshot); i++){
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+bool simSnapshot::isValid() const{
+    return magic == snapshotMagic && version == snapshotVersion && particles <= numParticles
+        && width == xsize && height == ysize && checksum == computeChecksum();
+}
+
+// Positions are truncated so a particle never rounds into the next cell over
+uint16_t quantizePosition(float position){
+    return static_cast<uint16_t>(position * snapshotPositionScale);
+}
+
+float dequantizePosition(uint16_t position){
+    return (position + 0.5f) / snapshotPositionScale;
+}
+
+int16_t quantizeVelocity(float velocity){
+    return static_cast<int16_t>(clamp<float>(velocity * snapshotVelocityScale, -32767, 32767));
+}
+
+float dequantizeVelocity(int16_t velocity){
+    return velocity / snapshotVelocityScale;
+}
+
+void fluidWindow::save(simSnapshot& snapshot){
+    snapshot = simSnapshot{};
+    snapshot.magic = snapshotMagic;
+    snapshot.version = snapshotVersion;
+    snapshot.particles = liveParticles;
+    snapshot.width = xsize;
+    snapshot.height = ysize;
+    snapshot.state = static_cast<uint8_t>(state);
+    snapshot.wakeTiltX = wakeTiltX;
+    snapshot.wakeTiltY = wakeTiltY;
+    snapshot.loopNumber = loopNumber;
+    // Stored by particleId, so a restored particle keeps its id whatever order the array is in
+    for(fluidParticle& particle : live()){
+        uint32_t p = particle.particleId;
+        snapshot.live[p / 8] |= 1 << (p % 8);
+        snapshot.particle[p].x = quantizePosition(particle.getX());
+        snapshot.particle[p].y = quantizePosition(particle.getY());
+        snapshot.particle[p].vx = quantizeVelocity(particle.vx);
+        snapshot.particle[p].vy = quantizeVelocity(particle.vy);
+        if(particle.asleep){
+            snapshot.asleep[p / 8] |= 1 << (p % 8);
+        }
+    }
+    snapshot.checksum = snapshot.computeChecksum();
+}
+
+// Leaves the window untouched and returns false if the snapshot doesn't fit this build
+bool fluidWindow::restore(const simSnapshot& snapshot){
+    if(!snapshot.isValid()){
+        return false;
+    }
+    uint32_t liveIds = 0;
+    for(uint32_t p = 0; p < numParticles; p++){
+        if(!(snapshot.live[p / 8] >> (p % 8) & 1)){
+            continue;
+        }
+        const snapshotParticle& saved = snapshot.particle[p];
+        int cellX = floor(dequantizePosition(saved.x));
+        int cellY = floor(dequantizePosition(saved.y));
+        if(cellX >= xsize || cellY >= ysize || panel.solid[cellX][cellY]){
+            return false;
+        }
+        liveIds++;
+    }
+    if(liveIds != snapshot.particles){
+        return false;
+    }
+
+    initCells();
+    state = static_cast<enumBadgeState>(snapshot.state);
+    loopNumber = snapshot.loopNumber;
+    // Until the accelerometer says otherwise the badge is where the sleepers were left
+    tiltX = wakeTiltX = snapshot.wakeTiltX;
+    tiltY = wakeTiltY = snapshot.wakeTiltY;
+    wakeState = state;
+    sleepingParticles = 0;
+    liveParticles = 0;
+    for(uint32_t p = 0; p < numParticles; p++){
+        if(!(snapshot.live[p / 8] >> (p % 8) & 1)){
+            continue;
+        }
+        fluidParticle& particle = particleArray[liveParticles++];
+        const snapshotParticle& saved = snapshot.particle[p];
+        particle.setCoordinates(dequantizePosition(saved.x), dequantizePosition(saved.y));
+        particle.vx = dequantizeVelocity(saved.vx);
+        particle.vy = dequantizeVelocity(saved.vy);
+        particle.particleId = p;
+        particle.asleep = particleSleepBuilt && params.particleSleep && (snapshot.asleep[p / 8] >> (p % 8) & 1);
+        particle.restFrames = particle.asleep ? sleepFrames : 0;
+        particle.restX = particle.getX();
+        particle.restY = particle.getY();
+        sleepingParticles += particle.asleep;
+    }
+    // Highest first, so the free list hands out the lowest id next like after init
+    freeIdCount = 0;
+    for(uint32_t p = numParticles; p-- > 0;){
+        if(!(snapshot.live[p / 8] >> (p % 8) & 1)){
+            freeIds[freeIdCount++] = p;
+        }
+    }
+    binningValid = false;
+    rebuildBinning();
+    return true;
+}
+
+// Handed from the core that simulates to the one that writes it out
+class snapshotMailbox {
+    public:
+        simSnapshot snapshot;
+        std::atomic<bool> pending{false};
+};
+
+#if PICO_ON_DEVICE
+// Flash is only rewritten once the pack has been left still for a while, and no more often
+// than the interval. An erase stalls both cores for about 50 ms and the sector is good for
+// 100k of them.
+static constexpr uint32_t snapshotIntervalFrames{5*60*framesPerSecond};
+static constexpr uint32_t snapshotStillFrames{10*framesPerSecond};  // Tilt and state unchanged this long
+static constexpr uint32_t snapshotFlashOffset{PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE};
+static constexpr uint32_t snapshotLockoutMs{10};
+
+static_assert(sizeof(simSnapshot) <= FLASH_SECTOR_SIZE, "a snapshot must fit in one flash sector");
+
+extern char __flash_binary_end;
+
+bool readSnapshot(simSnapshot& snapshot){
+    memcpy(&snapshot, reinterpret_cast<const void*>(XIP_BASE + snapshotFlashOffset), sizeof(snapshot));
+    return snapshot.isValid();
+}
+
+// Runs with the other core locked out and interrupts off
+void programSnapshot(void* data){
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    constexpr size_t wholePages = sizeof(simSnapshot) / FLASH_PAGE_SIZE * FLASH_PAGE_SIZE;
+    flash_range_erase(snapshotFlashOffset, FLASH_SECTOR_SIZE);
+    flash_range_program(snapshotFlashOffset, bytes, wholePages);
+    // The last page is padded out with erased bytes
+    uint8_t page[FLASH_PAGE_SIZE];
+    memset(page, 0xFF, sizeof(page));
+    memcpy(page, bytes + wholePages, sizeof(simSnapshot) - wholePages);
+    flash_range_program(snapshotFlashOffset + wholePages, page, FLASH_PAGE_SIZE);
+}
+
+// The other core has to have called flash_safe_execute_core_init
+bool writeSnapshot(const simSnapshot& snapshot){
+    // Never erase into the program itself
+    if(reinterpret_cast<uintptr_t>(&__flash_binary_end) - XIP_BASE > snapshotFlashOffset){
+        return false;
+    }
+    const simSnapshot* stored = reinterpret_cast<const simSnapshot*>(XIP_BASE + snapshotFlashOffset);
+    if(stored->isValid() && stored->checksum == snapshot.checksum){
+        return true;
+    }
+    return flash_safe_execute(programSnapshot, const_cast<simSnapshot*>(&snapshot), snapshotLockoutMs) == PICO_OK;
+}
+#else
+bool readSnapshot(simSnapshot& snapshot, const char* path){
+    FILE* file = fopen(path, "rb");
+    if(!file){
+        return false;
+    }
+    bool read = fread(&snapshot, sizeof(snapshot), 1, file) == 1;
+    fclose(file);
+    return read && snapshot.isValid();
+}
+
+bool writeSnapshot(const simSnapshot& snapshot, const char* path){
+    FILE* file = fopen(path, "wb");
+    if(!file){
+        return false;
+    }
+    bool written = fwrite(&snapshot, sizeof(snapshot), 1, file) == 1;
+    return fclose(file) == 0 && written;
+}
+#endif
@@ -0,0 +1,92 @@
+#pragma once
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include "fluid-sim.h"
+#include "frame-stream.h"
+#include "batch-runner.h"
+
+// Host-only recording of a window's rendered frames as a frame stream. The tilt comes from
+// the same traces as the batch mode.
+
+// Records what print() renders into a frame stream, see frame-stream.h
+class frameStreamSink : public displaySink {
+    public:
+        bool open(const char* path);
+        void show(const cellBrightness& cells) override;
+        frameStreamWriter writer;
+        double writeUs{0};  // Spent encoding and writing
+        bool failed{false};
+};
+
+bool frameStreamSink::open(const char* path){
+    frameStreamHeader header;
+    header.xsize = xsize;
+    header.ysize = ysize;
+    header.framesPerSecond = framesPerSecond;
+    header.led.resize(header.cells());
+    for(int x = 0; x < xsize; x++){
+        for(int y = 0; y < ysize; y++){
+            header.led[x*ysize + y] = panel.render[x][y].driver != noLed;
+        }
+    }
+    return writer.open(path, header);
+}
+
+void frameStreamSink::show(const cellBrightness& cells){
+    auto start = std::chrono::steady_clock::now();
+    failed |= !writer.write(&cells[0][0]);
+    writeUs += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Runs one window and records every frame it renders, for viewing with frame-stream-tool
+// or comparing against another run. Without a trace file, or with "-", the tilt swings
+// the same way as in the batch mode.
+//
+//   my_project stream [stream file] [frames] [trace file] [seed]
+int runStreamRecording(int argc, char** argv){
+    const char* path = argc > 2 ? argv[2] : "fluid.fst";
+    uint32_t frames = argc > 3 ? atoi(argv[3]) : 600;
+    uint32_t seed = argc > 5 ? atoi(argv[5]) : 1;
+    std::vector<inputSample> trace;
+    if(argc > 4 && strcmp(argv[4], "-") != 0){
+        if(!loadTrace(argv[4], trace)){
+            fprintf(stderr, "Can't read trace %s\n", argv[4]);
+            return 1;
+        }
+    } else {
+        trace = makeSwingTrace(frames, seed);
+    }
+
+    auto sink = std::make_unique<frameStreamSink>();
+    if(!sink->open(path)){
+        fprintf(stderr, "Can't write %s\n", path);
+        return 1;
+    }
+    auto window = std::make_unique<fluidWindow>();
+    window->params.adaptiveQuality = false;
+    window->display = sink.get();
+    window->init(seed);
+
+    auto start = std::chrono::steady_clock::now();
+    for(const auto& sample : trace){
+        window->tiltX = sample.tiltX;
+        window->tiltY = sample.tiltY;
+        window->state = sample.state;
+        window->stepSim();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    sink->writer.close();
+    if(sink->failed){
+        fprintf(stderr, "Writing %s failed\n", path);
+        return 1;
+    }
+    uint32_t written = sink->writer.frames;
+    fprintf(stderr, "%lu frames, %lu bytes, %.1f bytes per frame\n", (unsigned long)written,
+            (unsigned long)sink->writer.bytes, written > 0 ? sink->writer.bytes / static_cast<double>(written) : 0.0);
+    fprintf(stderr, "%.0f frames/s simulated and recorded, %.2f us per frame recording\n",
+            written / seconds, written > 0 ? sink->writeUs / written : 0.0);
+    return 0;
+}
@@ -0,0 +1,77 @@
+#include <cstdio>
+#include <cstring>
+#include "telemetry.h"
+
+// Host tool that turns the badge's USB serial stream back into text
+//
+//   telemetry-decode [capture file or serial device]
+//
+// reads stdin without an argument. Bytes that aren't part of a telemetry frame are the
+// firmware's ordinary stdio output and are passed through as they are.
+
+void printRecord(const telemetryRecord& record){
+    printf("%10lu us core %u ", (unsigned long)record.timeUs, record.core);
+    if(record.event >= telemetryEventCount){
+        printf("unknown event %u a=%u b=%lu c=%lu\n", record.event, record.a,
+               (unsigned long)record.b, (unsigned long)record.c);
+        return;
+    }
+    const telemetryEventInfo& info = telemetryEvents[record.event];
+    printf("%s", info.name);
+    if(info.a[0]){
+        printf(" %s=%u", info.a, record.a);
+    }
+    if(info.b[0]){
+        printf(" %s=%lu", info.b, (unsigned long)record.b);
+    }
+    if(info.c[0]){
+        printf(" %s=%lu", info.c, (unsigned long)record.c);
+    }
+    printf("\n");
+}
+
+// Whether the bytes so far could still be the start of a frame
+bool framePrefixValid(const uint8_t* frame, size_t have){
+    if(have >= 1 && frame[0] != telemetrySync0){
+        return false;
+    }
+    if(have >= 2 && frame[1] != telemetrySync1){
+        return false;
+    }
+    if(have == telemetryFrameBytes){
+        return telemetryChecksum(frame + 2, sizeof(telemetryRecord)) == frame[telemetryFrameBytes - 1];
+    }
+    return true;
+}
+
+int main(int argc, char** argv){
+    FILE* in = argc > 1 ? fopen(argv[1], "rb") : stdin;
+    if(!in){
+        fprintf(stderr, "Can't open %s\n", argv[1]);
+        return 1;
+    }
+    setvbuf(stdout, nullptr, _IOLBF, 0);
+
+    uint8_t frame[telemetryFrameBytes];
+    size_t have = 0;
+    unsigned long records = 0;
+    int c;
+    while((c = fgetc(in)) != EOF){
+        frame[have++] = c;
+        // On a mismatch the first byte was text, the rest may still start a frame
+        while(have > 0 && !framePrefixValid(frame, have)){
+            putchar(frame[0]);
+            memmove(frame, frame + 1, --have);
+        }
+        if(have == telemetryFrameBytes){
+            telemetryRecord record;
+            memcpy(&record, frame + 2, sizeof(record));
+            printRecord(record);
+            records++;
+            have = 0;
+        }
+    }
+    fwrite(frame, 1, have, stdout);
+    fprintf(stderr, "%lu records\n", records);
+    return 0;
+}
@@ -0,0 +1,227 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include "pico/stdlib.h"
+#if PICO_ON_DEVICE
+#include "tusb.h"
+#endif
+
+// Binary event log for the frame loop. Code on either core appends fixed-size records to
+// its own core's ring, without locks, formatting or waiting; a full ring drops the record
+// and counts it. Core 0 drains both rings between frames, as far as the USB buffer has
+// room, and telemetry-decode turns the stream back into text on the host.
+//
+// Each ring has one writer, so nothing may log from an interrupt handler.
+
+enum class telemetryEvent : uint8_t {
+    dropped,          // Records lost to a full ring
+    badParticleSlot,
+    accelFailed,
+    ledWriteFailed,
+    stageFrames,
+    stageTiming,
+    stageJitter,
+    qualityLevel,
+    qualityFrames,
+    sleeping,
+    binningUpdates,
+    binningMoves,
+    snapshotRestored,
+    snapshotSaved,
+    clockFrame,
+    clockLevels,
+    attractorBuilt,
+    busRecovered,
+    busRecoveries,
+    busCached,
+    tiltLatency,
+    tiltLatencyBins,
+    count
+};
+
+static constexpr int telemetryEventCount = static_cast<int>(telemetryEvent::count);
+
+// What the decoder calls each event and its three arguments, empty names aren't printed
+class telemetryEventInfo {
+    public:
+        const char* name;
+        const char* a;
+        const char* b;
+        const char* c;
+};
+
+static constexpr std::array<telemetryEventInfo, telemetryEventCount> telemetryEvents {{
+    {"dropped",         "core",       "records",   ""},
+    {"badParticleSlot", "cell",       "slot",      "particle"},
+    {"accelFailed",     "",           "abort",     ""},
+    {"ledWriteFailed",  "driver",     "abort",     ""},
+    {"stageFrames",     "stage",      "frames",    "overruns"},
+    {"stageTiming",     "stage",      "dropped",   "worstUs"},
+    {"stageJitter",     "stageBin",   "count",     "nextCount"},
+    {"qualityLevel",    "level",      "frameUs",   ""},
+    {"qualityFrames",   "level",      "frames",    ""},
+    {"sleeping",        "particles",  "",          ""},
+    {"binningUpdates",  "",           "rebuilds",  "incremental"},
+    {"binningMoves",    "",           "moved",     "swaps"},
+    {"snapshotRestored","sleeping",   "loop",      ""},
+    {"snapshotSaved",   "ok",         "writeUs",   ""},
+    {"clockFrame",      "mhz",        "simBusyUs", "simSlackUs"},
+    {"clockLevels",     "mhz",        "frames",    ""},
+    {"attractorBuilt",  "cells",      "buildUs",   "fits"},
+    {"busRecovered",    "failures",   "recoveryUs","backoffUs"},
+    {"busRecoveries",   "",           "recoveries","worstRunUs"},
+    {"busCached",       "",           "accelFrames","ledFrames"},
+    {"tiltLatency",     "segment",    "meanUs",    "worstUs"},
+    {"tiltLatencyBins", "bin",        "count",     "nextCount"}
+}};
+
+class telemetryRecord {
+    public:
+        uint32_t timeUs{0};
+        uint8_t event{0};
+        uint8_t core{0};
+        uint16_t a{0};
+        uint32_t b{0};
+        uint32_t c{0};
+};
+
+static_assert(sizeof(telemetryRecord) == 16, "telemetry records are 16 bytes on the wire");
+
+// On the wire each record, little endian, sits between two sync bytes and a checksum so
+// the decoder can find records again among ordinary stdio text
+static constexpr uint8_t telemetrySync0{0xA5};
+static constexpr uint8_t telemetrySync1{0x5A};
+static constexpr size_t telemetryFrameBytes{2 + sizeof(telemetryRecord) + 1};
+
+uint8_t telemetryChecksum(const uint8_t* bytes, size_t length){
+    uint8_t sum = 0;
+    for(size_t i = 0; i < length; i++){
+        sum += bytes[i];
+    }
+    return sum;
+}
+
+// Single producer, single consumer
+template <size_t Size>
+class telemetryRing {
+    static_assert((Size & (Size - 1)) == 0, "ring size must be a power of two");
+    public:
+        bool push(const telemetryRecord& record);
+        bool pop(telemetryRecord& record);
+        std::atomic<uint32_t> dropped{0};
+    private:
+        std::array<telemetryRecord, Size> records{};
+        std::atomic<uint32_t> head{0};  // Only written by the producer
+        std::atomic<uint32_t> tail{0};  // Only written by the consumer
+};
+
+template <size_t Size>
+bool telemetryRing<Size>::push(const telemetryRecord& record){
+    uint32_t h = head.load(std::memory_order_relaxed);
+    if(h - tail.load(std::memory_order_acquire) >= Size){
+        dropped.store(dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return false;
+    }
+    records[h % Size] = record;
+    head.store(h + 1, std::memory_order_release);
+    return true;
+}
+
+template <size_t Size>
+bool telemetryRing<Size>::pop(telemetryRecord& record){
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    if(t == head.load(std::memory_order_acquire)){
+        return false;
+    }
+    record = records[t % Size];
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+}
+
+static constexpr size_t telemetryRingSize{64};
+static constexpr int telemetryDrainPerFrame{16};
+
+class telemetryLog {
+    public:
+        void log(telemetryEvent event, uint16_t a = 0, uint32_t b = 0, uint32_t c = 0);
+        void drain();
+#if !PICO_ON_DEVICE
+        FILE* sink{nullptr};  // Host builds only log, single threaded, when this is set
+#endif
+    private:
+        std::array<telemetryRing<telemetryRingSize>, 2> rings;
+        std::array<uint32_t, 2> reportedDrops{};
+        bool canSend();
+        void send(const telemetryRecord& record);
+};
+
+void telemetryLog::log(telemetryEvent event, uint16_t a, uint32_t b, uint32_t c){
+#if !PICO_ON_DEVICE
+    // Batch runs step many windows on worker threads that would all share ring 0
+    if(!sink){
+        return;
+    }
+#endif
+    telemetryRecord record;
+    record.timeUs = time_us_32();
+    record.event = static_cast<uint8_t>(event);
+    record.core = get_core_num();
+    record.a = a;
+    record.b = b;
+    record.c = c;
+    rings[record.core].push(record);
+}
+
+bool telemetryLog::canSend(){
+#if PICO_ON_DEVICE
+    // Only write what fits, stdio would otherwise wait for the host to read
+    return stdio_usb_connected() && tud_cdc_write_available() >= telemetryFrameBytes;
+#else
+    return true;
+#endif
+}
+
+void telemetryLog::send(const telemetryRecord& record){
+    uint8_t frame[telemetryFrameBytes];
+    frame[0] = telemetrySync0;
+    frame[1] = telemetrySync1;
+    memcpy(frame + 2, &record, sizeof(record));
+    frame[telemetryFrameBytes - 1] = telemetryChecksum(frame + 2, sizeof(record));
+#if PICO_ON_DEVICE
+    stdio_put_string(reinterpret_cast<const char*>(frame), telemetryFrameBytes, false, false);
+#else
+    if(sink){
+        fwrite(frame, 1, telemetryFrameBytes, sink);
+    }
+#endif
+}
+
+// Called from core 0 only. Records stay queued until the USB buffer has room for them.
+void telemetryLog::drain(){
+    int budget = telemetryDrainPerFrame;
+    for(uint8_t core = 0; core < rings.size(); core++){
+        auto& ring = rings[core];
+        uint32_t drops = ring.dropped.load(std::memory_order_relaxed);
+        if(drops != reportedDrops[core] && budget > 0 && canSend()){
+            telemetryRecord record;
+            record.timeUs = time_us_32();
+            record.event = static_cast<uint8_t>(telemetryEvent::dropped);
+            record.core = core;
+            record.a = core;
+            record.b = drops - reportedDrops[core];
+            send(record);
+            reportedDrops[core] = drops;
+            budget--;
+        }
+        telemetryRecord record;
+        while(budget > 0 && canSend() && ring.pop(record)){
+            send(record);
+            budget--;
+        }
+    }
+}
+
+static telemetryLog telemetry;
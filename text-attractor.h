@@ -0,0 +1,402 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include "fluid-sim.h"
+#if !PICO_ON_DEVICE
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#endif
+
+// Names drawn at runtime instead of by hand in gravity-fields.h. A string is rasterised
+// with a small bitmap font into an attractor mask, then the high-res force field is summed
+// from a precomputed kernel table. computeForceAt works out the same kernel in floats for
+// every pair of grid cell and high-res point, which takes seconds on the M0+.
+//
+// The 1/(dx^4+dy^4+1) kernel isn't separable and an FFT over the padded grid costs more
+// than it saves for a sparse mask, so the field is a direct sum over the set cells only,
+// every term a table lookup and an integer add.
+
+// Glyphs are 5 rows tall and up to 5 columns wide. Rows run along x, the text reads
+// along y, the way the hand-drawn names sit on the badge.
+static constexpr int glyphRows{5};
+
+class glyph {
+    public:
+        char character;
+        const char* rows[glyphRows];
+        constexpr int width() const {
+            int w = 0;
+            while(rows[0][w] != '\0'){
+                w++;
+            }
+            return w;
+        }
+};
+
+static constexpr std::array<glyph, 45> attractorFont {{
+    {'A', {".##.", "#..#", "####", "#..#", "#..#"}},
+    {'B', {"###.", "#..#", "###.", "#..#", "###."}},
+    {'C', {".###", "#...", "#...", "#...", ".###"}},
+    {'D', {"###.", "#..#", "#..#", "#..#", "###."}},
+    {'E', {"####", "#...", "###.", "#...", "####"}},
+    {'F', {"####", "#...", "###.", "#...", "#..."}},
+    {'G', {".###", "#...", "#.##", "#..#", ".###"}},
+    {'H', {"#..#", "#..#", "####", "#..#", "#..#"}},
+    {'I', {"###", ".#.", ".#.", ".#.", "###"}},
+    {'J', {"..##", "...#", "...#", "#..#", ".##."}},
+    {'K', {"#..#", "#.#.", "##..", "#.#.", "#..#"}},
+    {'L', {"#...", "#...", "#...", "#...", "####"}},
+    {'M', {"#...#", "##.##", "#.#.#", "#...#", "#...#"}},
+    {'N', {"#..#", "##.#", "#.##", "#..#", "#..#"}},
+    {'O', {".##.", "#..#", "#..#", "#..#", ".##."}},
+    {'P', {"###.", "#..#", "###.", "#...", "#..."}},
+    {'Q', {".##.", "#..#", "#..#", "#.#.", ".#.#"}},
+    {'R', {"###.", "#..#", "###.", "#.#.", "#..#"}},
+    {'S', {".###", "#...", ".##.", "...#", "###."}},
+    {'T', {"###", ".#.", ".#.", ".#.", ".#."}},
+    {'U', {"#..#", "#..#", "#..#", "#..#", ".##."}},
+    {'V', {"#...#", "#...#", "#...#", ".#.#.", "..#.."}},
+    {'W', {"#...#", "#...#", "#.#.#", "##.##", "#...#"}},
+    {'X', {"#..#", "#..#", ".##.", "#..#", "#..#"}},
+    {'Y', {"#.#", "#.#", ".#.", ".#.", ".#."}},
+    {'Z', {"####", "...#", ".##.", "#...", "####"}},
+    {'0', {".##.", "#.##", "##.#", "#..#", ".##."}},
+    {'1', {".#", "##", ".#", ".#", ".#"}},
+    {'2', {"###.", "...#", ".##.", "#...", "####"}},
+    {'3', {"###.", "...#", ".##.", "...#", "###."}},
+    {'4', {"#..#", "#..#", "####", "...#", "...#"}},
+    {'5', {"####", "#...", "###.", "...#", "###."}},
+    {'6', {".##.", "#...", "###.", "#..#", ".##."}},
+    {'7', {"####", "...#", "..#.", ".#..", ".#.."}},
+    {'8', {".##.", "#..#", ".##.", "#..#", ".##."}},
+    {'9', {".##.", "#..#", ".###", "...#", ".##."}},
+    {' ', {".", ".", ".", ".", "."}},
+    {'!', {"#", "#", "#", ".", "#"}},
+    {'.', {".", ".", ".", ".", "#"}},
+    {',', {"..", "..", "..", ".#", "#."}},
+    {'\'', {"#", "#", ".", ".", "."}},
+    {'-', {"...", "...", "###", "...", "..."}},
+    {'+', {"...", ".#.", "###", ".#.", "..."}},
+    {'<', {"..#", ".#.", "#..", ".#.", "..#"}},
+    {'?', {"###.", "...#", ".##.", "....", ".#.."}}
+}};
+
+// Lower case is drawn as upper case, anything else the font lacks as '?'
+const glyph& glyphFor(char c){
+    if(c >= 'a' && c <= 'z'){
+        c = c - 'a' + 'A';
+    }
+    for(const glyph& g : attractorFont){
+        if(g.character == c){
+            return g;
+        }
+    }
+    return attractorFont.back();
+}
+
+// Cells from the first glyph's left edge to the last one's right, one blank column between
+int textWidth(const char* begin, const char* end){
+    int width = -1;
+    for(const char* c = begin; c < end; c++){
+        width += glyphFor(*c).width() + 1;
+    }
+    return width > 0 ? width : 0;
+}
+
+using attractorMask = std::array<std::array<uint8_t, GRID_Y>, GRID_X>;
+
+static constexpr int textLineCells{GRID_Y - 2};  // Inside the border, along the reading direction
+static constexpr int maxTextLines{(GRID_X - 2 + 1) / (glyphRows + 1)};
+
+// Breaks the text into lines at spaces and centres them on the panel. Returns false if
+// some of it didn't fit, a word longer than a line is cut short and extra lines dropped.
+bool rasterizeText(const char* text, attractorMask& mask){
+    mask = {};
+    std::array<const char*, maxTextLines> lineBegin{};
+    std::array<const char*, maxTextLines> lineEnd{};
+    int lines = 0;
+    bool fits = true;
+    const char* c = text;
+    while(true){
+        while(*c == ' '){
+            c++;
+        }
+        if(*c == '\0'){
+            break;
+        }
+        if(lines == maxTextLines){
+            fits = false;
+            break;
+        }
+        const char* begin = c;
+        const char* end = c;
+        // Whole words for as long as they fit
+        while(*c != '\0'){
+            const char* wordEnd = c;
+            while(*wordEnd != '\0' && *wordEnd != ' '){
+                wordEnd++;
+            }
+            if(textWidth(begin, wordEnd) > textLineCells){
+                break;
+            }
+            end = c = wordEnd;
+            while(*c == ' '){
+                c++;
+            }
+        }
+        if(end == begin){
+            while(textWidth(begin, end + 1) <= textLineCells){
+                end++;
+            }
+            while(*c != '\0' && *c != ' '){
+                c++;
+            }
+            fits = false;
+        }
+        lineBegin[lines] = begin;
+        lineEnd[lines] = end;
+        lines++;
+    }
+
+    int top = 1 + (GRID_X - 2 - (lines * (glyphRows + 1) - 1)) / 2;
+    for(int line = 0; line < lines; line++){
+        int left = 1 + (textLineCells - textWidth(lineBegin[line], lineEnd[line])) / 2;
+        for(const char* ch = lineBegin[line]; ch < lineEnd[line]; ch++){
+            const glyph& g = glyphFor(*ch);
+            for(int row = 0; row < glyphRows; row++){
+                for(int column = 0; column < g.width(); column++){
+                    if(g.rows[row][column] == '#'){
+                        mask[top + line * (glyphRows + 1) + row][left + column] = 1;
+                    }
+                }
+            }
+            left += g.width() + 1;
+        }
+    }
+    return fits;
+}
+
+// Force of one attractor cell at every high-res offset from its centre, by distance along
+// each axis. Q22 fixed point, the sign comes from the side of the cell the point is on.
+static constexpr int attractorKernelBits{22};
+static constexpr float attractorKernelLsb{1.0f / (1 << attractorKernelBits)};
+
+struct attractorKernelTable {
+    std::array<std::array<int32_t, HIGH_Y>, HIGH_X> kx;
+    std::array<std::array<int32_t, HIGH_Y>, HIGH_X> ky;
+};
+
+// The same arithmetic as computeForceAt, so both agree to within rounding
+constexpr attractorKernelTable makeAttractorKernel() {
+    attractorKernelTable kernel = {};
+    for (int dx = 0; dx < HIGH_X; ++dx) {
+        for (int dy = 0; dy < HIGH_Y; ++dy) {
+            float fdx = dx, fdy = dy;
+            float dist4 = fdx * fdx * fdx * fdx + fdy * fdy * fdy * fdy + 1.0f;
+            float forceMag = attractorStrength / dist4;
+            kernel.kx[dx][dy] = static_cast<int32_t>(fdx * forceMag * (1 << attractorKernelBits) + 0.5f);
+            kernel.ky[dx][dy] = static_cast<int32_t>(fdy * forceMag * (1 << attractorKernelBits) + 0.5f);
+        }
+    }
+    return kernel;
+}
+
+static constexpr attractorKernelTable attractorKernel = makeAttractorKernel();
+
+constexpr int64_t kernelSum(const std::array<std::array<int32_t, HIGH_Y>, HIGH_X>& k) {
+    int64_t sum = 0;
+    for (const auto& column : k) {
+        for (int32_t v : column) {
+            sum += v;
+        }
+    }
+    return sum;
+}
+
+// No two cells share an offset from a point, and at most four share the same distances,
+// so even a full mask keeps every sum within 32 bits
+static_assert(4 * kernelSum(attractorKernel.kx) <= INT32_MAX && 4 * kernelSum(attractorKernel.ky) <= INT32_MAX,
+              "attractor force sums must fit in 32 bits");
+
+// Velocity kept per frame by particles inside the name, 1 everywhere else
+using attractorDamping = std::array<std::array<float, GRID_Y>, GRID_X>;
+static constexpr float nameDamping{0.995f};
+
+constexpr attractorDamping dampingForMask(const attractorMask& mask){
+    attractorDamping damping{};
+    for(int gx = 0; gx < GRID_X; gx++){
+        for(int gy = 0; gy < GRID_Y; gy++){
+            damping[gx][gy] = mask[gx][gy] ? nameDamping : 1.0f;
+        }
+    }
+    return damping;
+}
+
+// The force table, cell mask and damping the particles are drawn to in displayname1
+class attractorField {
+    public:
+        const quantizedGravityField* force;
+        const attractorMask* mask;
+        const attractorDamping* damping;
+};
+
+static constexpr quantizedGravityField highResGravityField = quantizeGravityField(gravityField);
+static constexpr attractorDamping builtinDamping = dampingForMask(gravityField);
+static constexpr attractorField builtinAttractor{&highResGravityField, &gravityField, &builtinDamping};
+
+// Read once per frame by whichever core simulates, swapped by the one that builds a name
+std::atomic<const attractorField*> activeAttractor{&builtinAttractor};
+
+// Builds a field one high-res column per step, so core 0 can spread it between its I/O.
+// The strongest force sets the quantization scale, so the columns are summed twice, once
+// to find it and once to store them. Every set mask cell is an attractor of unit strength.
+class attractorBuilder {
+    public:
+        attractorMask mask{};
+        quantizedGravityField field{};
+        attractorDamping damping{};
+        attractorField attractor{&field, &mask, &damping};
+        void start();
+        bool step();  // True once the field is complete
+        void build();
+        uint16_t cells(){ return pointCount; }
+    private:
+        std::array<std::array<int16_t, 2>, GRID_X * GRID_Y> points{};  // High-res centres of the set cells
+        uint16_t pointCount{0};
+        std::array<int32_t, HIGH_Y> sumX{};
+        std::array<int32_t, HIGH_Y> sumY{};
+        int32_t maxX{0};
+        int32_t maxY{0};
+        uint8_t column{0};
+        bool quantizing{false};
+        void sumColumn(int x);
+};
+
+void attractorBuilder::start(){
+    damping = dampingForMask(mask);
+    pointCount = 0;
+    for(int gx = 0; gx < GRID_X; gx++){
+        for(int gy = 0; gy < GRID_Y; gy++){
+            if(mask[gx][gy]){
+                points[pointCount++] = {static_cast<int16_t>(gx * UPSCALE + UPSCALE / 2),
+                                        static_cast<int16_t>(gy * UPSCALE + UPSCALE / 2)};
+            }
+        }
+    }
+    column = 0;
+    quantizing = false;
+    maxX = maxY = 0;
+}
+
+// Points below a cell's centre are pulled towards +y and those above towards -y, so each
+// cell's run along the column splits at its centre and the inner loops have no branches
+void attractorBuilder::sumColumn(int x){
+    sumX.fill(0);
+    sumY.fill(0);
+    for(uint16_t p = 0; p < pointCount; p++){
+        int dx = points[p][0] - x;
+        int32_t sign = dx < 0 ? -1 : 1;
+        const auto& kx = attractorKernel.kx[dx < 0 ? -dx : dx];
+        const auto& ky = attractorKernel.ky[dx < 0 ? -dx : dx];
+        int cy = points[p][1];
+        for(int y = 0; y < cy; y++){
+            sumX[y] += sign * kx[cy - y];
+            sumY[y] += ky[cy - y];
+        }
+        for(int y = cy; y < HIGH_Y; y++){
+            sumX[y] += sign * kx[y - cy];
+            sumY[y] -= ky[y - cy];
+        }
+    }
+}
+
+bool attractorBuilder::step(){
+    sumColumn(column);
+    if(!quantizing){
+        for(int y = 0; y < HIGH_Y; y++){
+            maxX = abs(sumX[y]) > maxX ? abs(sumX[y]) : maxX;
+            maxY = abs(sumY[y]) > maxY ? abs(sumY[y]) : maxY;
+        }
+    } else {
+        for(int y = 0; y < HIGH_Y; y++){
+            field.force[column][y].fx = quantizeForce(sumX[y] * attractorKernelLsb, field.scaleX);
+            field.force[column][y].fy = quantizeForce(sumY[y] * attractorKernelLsb, field.scaleY);
+        }
+    }
+    if(++column < HIGH_X){
+        return false;
+    }
+    if(quantizing){
+        return true;
+    }
+    // Full int16 range maps onto the strongest force, an empty field keeps a unit scale
+    field.scaleX = maxX > 0 ? maxX * attractorKernelLsb / 32767.0f : 1.0f;
+    field.scaleY = maxY > 0 ? maxY * attractorKernelLsb / 32767.0f : 1.0f;
+    quantizing = true;
+    column = 0;
+    return false;
+}
+
+void attractorBuilder::build(){
+    start();
+    while(!step()){
+    }
+}
+
+#if !PICO_ON_DEVICE
+// Times the runtime pipeline against the compile-time generator on the hand-drawn names
+// and on the text given, and checks both come out the same
+//
+//   my_project attractor [text]
+int runAttractorBenchmark(int argc, char** argv){
+    const char* text = argc > 2 ? argv[2] : "HELLO WORLD";
+    auto builder = std::make_unique<attractorBuilder>();
+    auto reference = std::make_unique<quantizedGravityField>();
+    bool fits = rasterizeText(text, builder->mask);
+    printf("\"%s\"%s\n", text, fits ? "" : " (cut short)");
+    for(int x = 0; x < GRID_X; x++){
+        for(int y = 0; y < GRID_Y; y++){
+            putchar(builder->mask[x][y] ? '#' : '.');
+        }
+        putchar('\n');
+    }
+    attractorMask textMask = builder->mask;
+
+    const std::array<std::pair<const char*, const attractorMask*>, 6> masks {{
+        {"keno", &gravityField_keno}, {"loomy", &gravityField_loomy}, {"renly", &gravityField_renly},
+        {"mom", &gravityField_mom}, {"gravityField", &gravityField}, {"text", &textMask}
+    }};
+    printf("mask,cells,generateUs,buildUs,speedup,maxErrorLsb\n");
+    for(const auto& [name, mask] : masks){
+        constexpr int repeats = 20;
+        auto start = std::chrono::steady_clock::now();
+        for(int r = 0; r < repeats; r++){
+            *reference = quantizeGravityField(*mask);
+        }
+        double generateUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / repeats;
+        builder->mask = *mask;
+        start = std::chrono::steady_clock::now();
+        for(int r = 0; r < repeats; r++){
+            builder->build();
+        }
+        double buildUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / repeats;
+
+        // Both are compared in force units, the two scales can differ in their last bits
+        float maxError = 0;
+        for(int x = 0; x < HIGH_X; x++){
+            for(int y = 0; y < HIGH_Y; y++){
+                const gravityForceSample& a = reference->force[x][y];
+                const gravityForceSample& b = builder->field.force[x][y];
+                maxError = std::max(maxError, std::abs(a.fx * reference->scaleX - b.fx * builder->field.scaleX) / reference->scaleX);
+                maxError = std::max(maxError, std::abs(a.fy * reference->scaleY - b.fy * builder->field.scaleY) / reference->scaleY);
+            }
+        }
+        printf("%s,%u,%.0f,%.0f,%.1f,%.2f\n", name, builder->cells(), generateUs, buildUs, generateUs / buildUs, maxError);
+    }
+    return 0;
+}
+#endif
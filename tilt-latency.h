@@ -0,0 +1,125 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include "frame-scheduler.h"
+#include "telemetry.h"
+
+// Tilt-to-photon latency. Each accelerometer read is stamped when it completes, the stamp
+// goes with the frame simulated from it through the triple buffer and is closed when that
+// frame's LED upload finishes. Times are the low 32 bits of the microsecond clock, the
+// differences survive the wrap.
+//
+// Normally the read, the step and the upload all start on the frame tick, so a sample is
+// simulated on the tick after it and shown on the tick after that, two to three frames in
+// all. The low-latency path chains them inside one frame instead: core 1 waits for this
+// tick's read before stepping and core 0 uploads as soon as the step is published. The
+// step then only has what the read and the upload leave of the frame.
+
+#ifndef FLUID_LOW_LATENCY
+#define FLUID_LOW_LATENCY 0
+#endif
+
+static constexpr uint32_t latencyBinUs{2000};
+static constexpr int latencyBins{32};           // The last also takes everything over 62 ms
+static constexpr uint32_t maxSampleWaitUs{2000};  // Core 1 steps on the old tilt after this
+static constexpr uint32_t latencyPollUs{100};     // How often a waiting task checks the other core
+
+// What a frame was made from, carried along with its LED data
+class tiltStamp {
+    public:
+        uint32_t frame{0};      // Tick it was simulated on, 0 for one never simulated
+        uint32_t sampleUs{0};   // Accelerometer read completed
+        uint32_t stepUs{0};     // Simulation step started
+        uint32_t publishUs{0};  // Handed to core 0
+};
+
+class latencyHistogram {
+    public:
+        uint32_t count{0};
+        uint64_t sumUs{0};
+        uint32_t worstUs{0};
+        std::array<uint32_t, latencyBins> bins{};
+        void record(uint32_t us);
+        uint32_t meanUs() const { return count > 0 ? sumUs / count : 0; }
+};
+
+void latencyHistogram::record(uint32_t us){
+    uint32_t bin = us / latencyBinUs;
+    bins[bin < latencyBins ? bin : latencyBins - 1]++;
+    count++;
+    sumUs += us;
+    worstUs = us > worstUs ? us : worstUs;
+}
+
+enum class latencySegment {
+    sampleToStep,
+    stepToPublish,
+    publishToPhoton,
+    total
+};
+
+static constexpr int latencySegments{4};
+
+class tiltLatency {
+    public:
+        bool lowLatency{FLUID_LOW_LATENCY != 0};
+        std::atomic<uint32_t> sampledFrame{0};    // Latest tick core 0 has read or given up reading the accelerometer for
+        std::atomic<uint32_t> publishedFrame{0};  // Latest tick core 1 has published a frame for
+        std::array<latencyHistogram, latencySegments> segments{};
+        latencyHistogram& segment(latencySegment s){ return segments[static_cast<int>(s)]; }
+        void sampled(uint32_t frame);
+        void published(uint32_t frame);
+        void shown(const tiltStamp& stamp, uint32_t doneUs);
+#if PICO_ON_DEVICE
+        void waitForSample(frameScheduler& scheduler, uint32_t frame);
+#endif
+        void logStats();
+    private:
+        uint32_t lastShownFrame{0};
+};
+
+void tiltLatency::sampled(uint32_t frame){
+    sampledFrame.store(frame, std::memory_order_release);
+#if PICO_ON_DEVICE
+    __sev();
+#endif
+}
+
+void tiltLatency::published(uint32_t frame){
+    publishedFrame.store(frame, std::memory_order_release);
+}
+
+// Called once the last driver of a frame is written, the LEDs change as their registers do
+void tiltLatency::shown(const tiltStamp& stamp, uint32_t doneUs){
+    // A frame sent again because no newer one was ready shows nothing new
+    if(stamp.frame == 0 || stamp.frame == lastShownFrame || stamp.sampleUs == 0){
+        return;
+    }
+    lastShownFrame = stamp.frame;
+    segment(latencySegment::sampleToStep).record(stamp.stepUs - stamp.sampleUs);
+    segment(latencySegment::stepToPublish).record(stamp.publishUs - stamp.stepUs);
+    segment(latencySegment::publishToPhoton).record(doneUs - stamp.publishUs);
+    segment(latencySegment::total).record(doneUs - stamp.sampleUs);
+}
+
+#if PICO_ON_DEVICE
+// Core 1 on the low-latency path, woken by core 0's event once the read is in
+void tiltLatency::waitForSample(frameScheduler& scheduler, uint32_t frame){
+    uint64_t giveUpUs = scheduler.deadlineUs(frame - 1) + maxSampleWaitUs;
+    while(sampledFrame.load(std::memory_order_acquire) < frame && scheduler.clock.nowUs() < giveUpUs){
+        best_effort_wfe_or_timeout(from_us_since_boot(giveUpUs));
+    }
+}
+#endif
+
+// Mean and worst of every segment, then the total's histogram two bins to a record
+void tiltLatency::logStats(){
+    for(uint16_t s = 0; s < latencySegments; s++){
+        telemetry.log(telemetryEvent::tiltLatency, s, segments[s].meanUs(), segments[s].worstUs);
+    }
+    const latencyHistogram& total = segment(latencySegment::total);
+    for(uint16_t bin = 0; bin < latencyBins; bin += 2){
+        telemetry.log(telemetryEvent::tiltLatencyBins, bin, total.bins[bin], total.bins[bin+1]);
+    }
+}